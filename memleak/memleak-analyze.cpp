@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2010-2012 Sami Sorell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/***** memleak-analyze ******************************************************
+ *
+ * Offline analyzer of the binary event stream written by memleak. Replays
+ * the allocation and free events in time order and prints:
+ * - a timeline of live memory,
+ * - per-site peak usage,
+ * - leak candidates, ie. sites whose blocks are still live at the end.
+ *
+ * Usage: memleak-analyze [-t points] [-n sites] <event file>
+ *
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "memleak_events.h"
+
+
+struct site_stats
+{
+	std::string name;
+	long        line;
+	long        allocs;
+	long        frees;
+	long        live_blocks;
+	long        peak_blocks;
+	long long   live_bytes;
+	long long   peak_bytes;
+	uint64_t    peak_ticks;
+	uint64_t    oldest_live;  // Ticks of the oldest live block
+
+	site_stats() : line(0), allocs(0), frees(0), live_blocks(0), peak_blocks(0),
+		live_bytes(0), peak_bytes(0), peak_ticks(0), oldest_live(0) { }
+};
+
+struct live_block
+{
+	uint32_t site;
+	uint64_t size;
+	uint64_t ticks;
+};
+
+
+// Sites identified by return address have no line
+static std::string
+site_label(site_stats const &site)
+{
+	char line[32];
+
+	if (site.line <= 0) {
+		return site.name;
+	}
+
+	snprintf(line, sizeof(line), ": %ld", site.line);
+	return site.name + line;
+}
+
+
+static bool
+event_order(struct mlev_event const &a, struct mlev_event const &b)
+{
+	return a.ticks < b.ticks;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does:
+    Reads an event file in memory. Site records are stored in 'sites',
+	allocation and free events in 'events'.
+
+  Wants:
+    path   - The event file.
+	header - Where to store the file header.
+	sites  - Site table to fill.
+	events - Event list to fill.
+
+  Gives:
+    True on success.
+----------------------------------------------------------------------------*/
+
+static bool
+read_events(char const *const path, struct mlev_header &header,
+	std::map<uint32_t, site_stats> &sites, std::vector<struct mlev_event> &events)
+{
+	FILE *const in = fopen(path, "rb");
+	struct mlev_event event;
+
+	if (!in) {
+		perror(path);
+		return false;
+	}
+
+	if (fread(&header, sizeof(header), 1, in) != 1  ||
+		memcmp(header.magic, MLEV_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "%s: Not a memleak event file\n", path);
+		fclose(in);
+		return false;
+	}
+
+	if (header.version != MLEV_VERSION  ||  header.event_size != sizeof(struct mlev_event)) {
+		fprintf(stderr, "%s: Unsupported event file version %u\n", path, header.version);
+		fclose(in);
+		return false;
+	}
+
+	while (fread(&event, sizeof(event), 1, in) == 1) {
+		if (MLEV_SITE == event.type) {
+			std::string name((event.address + 7) & ~7ULL, '\0');
+
+			if (!name.empty()  &&  fread(&name[0], name.size(), 1, in) != 1) {
+				break;
+			}
+
+			name.resize(event.address);
+			sites[event.site].name = name;
+			sites[event.site].line = event.size;
+		}
+		else {
+			events.push_back(event);
+		}
+	}
+
+	fclose(in);
+
+	// Threads write in chunks, so the file is ordered only per thread
+	std::stable_sort(events.begin(), events.end(), event_order);
+
+	return true;
+}
+
+
+static double
+ticks_to_sec(struct mlev_header const &header, uint64_t const ticks)
+{
+	return ticks > header.start_ticks ? (double) (ticks - header.start_ticks) / header.ticks_per_sec : 0.0;
+}
+
+
+static bool
+by_peak_bytes(std::pair<uint32_t, site_stats const *> const &a, std::pair<uint32_t, site_stats const *> const &b)
+{
+	return a.second->peak_bytes > b.second->peak_bytes;
+}
+
+
+static bool
+by_live_bytes(std::pair<uint32_t, site_stats const *> const &a, std::pair<uint32_t, site_stats const *> const &b)
+{
+	return a.second->live_bytes > b.second->live_bytes;
+}
+
+
+static void
+usage(char const *const name)
+{
+	fprintf(stderr, "Usage: %s [-t points] [-n sites] <event file>\n"
+		"  -t points  Number of points in live memory timeline (default 20)\n"
+		"  -n sites   Number of sites listed (default 20, 0 = all)\n", name);
+}
+
+
+int main(int const argc, char *const argv[])
+{
+	struct mlev_header header;
+	std::map<uint32_t, site_stats> sites;
+	std::vector<struct mlev_event> events;
+	std::map<uint64_t, live_block> live;
+	int points = 20;
+	size_t max_sites = 20;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:n:h")) != -1) {
+		switch (opt) {
+		case 't':
+			points = atoi(optarg);
+		break;
+
+		case 'n':
+			max_sites = strtoul(optarg, NULL, 0);
+		break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!read_events(argv[optind], header, sites, events)) {
+		return 1;
+	}
+
+	if (events.empty()) {
+		printf("No allocation events\n");
+		return 0;
+	}
+
+	uint64_t const first = events.front().ticks;
+	uint64_t const last  = events.back().ticks;
+	uint64_t const step  = points > 0 ? (last - first) / points + 1 : 0;
+	uint64_t next_point  = first;
+	long long live_bytes = 0;
+	long long peak_bytes = 0;
+	uint64_t  peak_ticks = first;
+	long      unmatched  = 0;
+
+	printf("%lu events from %lu sites over %.3f s\n\n", events.size(), sites.size(),
+		(double) (last - first) / header.ticks_per_sec);
+
+	if (points > 0) {
+		printf("Live memory timeline\n");
+		printf("%12s %14s %10s\n", "time [s]", "live bytes", "blocks");
+	}
+
+	for (std::vector<struct mlev_event>::const_iterator it = events.begin(); it != events.end(); ++it) {
+		site_stats &site = sites[it->site];
+
+		while (points > 0  &&  it->ticks >= next_point) {
+			printf("%12.6f %14lld %10lu\n", ticks_to_sec(header, next_point), live_bytes, live.size());
+			next_point += step;
+		}
+
+		if (MLEV_ALLOC == it->type) {
+			live_block const block = { it->site, it->size, it->ticks };
+
+			live[it->address] = block;
+			++site.allocs;
+			++site.live_blocks;
+			site.live_bytes += it->size;
+			live_bytes += it->size;
+
+			if (site.live_bytes > site.peak_bytes) {
+				site.peak_bytes = site.live_bytes;
+				site.peak_ticks = it->ticks;
+			}
+			if (site.live_blocks > site.peak_blocks) {
+				site.peak_blocks = site.live_blocks;
+			}
+			if (live_bytes > peak_bytes) {
+				peak_bytes = live_bytes;
+				peak_ticks = it->ticks;
+			}
+		}
+		else if (MLEV_FREE == it->type) {
+			std::map<uint64_t, live_block>::iterator const block = live.find(it->address);
+
+			if (block == live.end()) {
+				// Allocated before the stream was opened
+				++unmatched;
+				continue;
+			}
+
+			++site.frees;
+			--site.live_blocks;
+			site.live_bytes -= block->second.size;
+			live_bytes -= block->second.size;
+			live.erase(block);
+		}
+	}
+
+	if (points > 0) {
+		printf("%12.6f %14lld %10lu\n\n", ticks_to_sec(header, last), live_bytes, live.size());
+	}
+
+	printf("Peak live memory %lld bytes at %.6f s\n", peak_bytes, ticks_to_sec(header, peak_ticks));
+
+	if (unmatched) {
+		printf("%ld frees of blocks allocated before recording started\n", unmatched);
+	}
+
+	// The oldest live block of every site
+	for (std::map<uint64_t, live_block>::const_iterator it = live.begin(); it != live.end(); ++it) {
+		site_stats &site = sites[it->second.site];
+
+		if (!site.oldest_live  ||  it->second.ticks < site.oldest_live) {
+			site.oldest_live = it->second.ticks;
+		}
+	}
+
+	std::vector<std::pair<uint32_t, site_stats const *> > ranked;
+
+	for (std::map<uint32_t, site_stats>::const_iterator it = sites.begin(); it != sites.end(); ++it) {
+		ranked.push_back(std::make_pair(it->first, &it->second));
+	}
+
+	size_t const listed = max_sites && max_sites < ranked.size() ? max_sites : ranked.size();
+
+	printf("\nPeak usage per site\n");
+	printf("%12s %8s %10s %10s %10s  %s\n", "peak bytes", "blocks", "at [s]", "allocs", "frees", "site");
+	std::sort(ranked.begin(), ranked.end(), by_peak_bytes);
+
+	for (size_t i = 0; i < listed; ++i) {
+		site_stats const &site = *ranked[i].second;
+
+		printf("%12lld %8ld %10.6f %10ld %10ld  %s\n", site.peak_bytes, site.peak_blocks,
+			ticks_to_sec(header, site.peak_ticks), site.allocs, site.frees, site_label(site).c_str());
+	}
+
+	printf("\nLeak candidates (live at the end)\n");
+	printf("%12s %8s %12s  %s\n", "live bytes", "blocks", "oldest [s]", "site");
+	std::sort(ranked.begin(), ranked.end(), by_live_bytes);
+
+	for (size_t i = 0; i < listed  &&  ranked[i].second->live_blocks > 0; ++i) {
+		site_stats const &site = *ranked[i].second;
+
+		printf("%12lld %8ld %12.6f  %s\n", site.live_bytes, site.live_blocks,
+			ticks_to_sec(header, site.oldest_live), site_label(site).c_str());
+	}
+
+	return 0;
+}
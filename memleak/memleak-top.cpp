@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2010-2012 Sami Sorell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/***** memleak-top **********************************************************
+ *
+ * Shows the live bytes, blocks and allocation rates of the sites of a
+ * running process, read from the shared memory segment it has opened with
+ * memleak_shm_open() (or MEMLEAK_SHM=1 with the preload library). The
+ * process is not stopped nor signalled.
+ *
+ * Usage: memleak-top [-d seconds] [-n sites] [-s bytes|blocks|rate] [-1] <pid>
+ *
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include "memleak_shm.h"
+
+
+struct site_stats
+{
+	struct mlshm_site const *site;
+	long   blocks;
+	long   bytes;
+	long   allocs;
+	double rate;   // Allocations per second since the previous refresh
+};
+
+enum sort_key { BY_BYTES, BY_BLOCKS, BY_RATE };
+
+static enum sort_key sort_by = BY_BYTES;
+
+
+static bool
+site_order(site_stats const &a, site_stats const &b)
+{
+	switch (sort_by) {
+	case BY_BLOCKS:  return a.blocks > b.blocks;
+	case BY_RATE:    return a.rate > b.rate;
+	default:         return a.bytes > b.bytes;
+	}
+}
+
+
+static double
+now_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does:
+    Maps the shared memory segment of a process read-only and checks its
+	layout.
+
+  Wants:
+    pid - The process.
+
+  Gives:
+    The segment's header, or NULL on failure.
+----------------------------------------------------------------------------*/
+
+static struct mlshm_header const *
+attach(int const pid)
+{
+	char name[32];
+	struct stat st;
+
+	snprintf(name, sizeof(name), MLSHM_NAME_FMT, pid);
+
+	int const fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0) {
+		fprintf(stderr, "No memleak shared memory for process %d: %s\n", pid, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st)  ||  (size_t) st.st_size < sizeof(struct mlshm_header)) {
+		fprintf(stderr, "%s: Not a memleak shared memory segment\n", name);
+		close(fd);
+		return NULL;
+	}
+
+	void *const mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (MAP_FAILED == mem) {
+		perror("mmap");
+		return NULL;
+	}
+
+	struct mlshm_header const *const header = (struct mlshm_header const *) mem;
+
+	if (memcmp(header->magic, MLSHM_MAGIC, sizeof(header->magic)) != 0) {
+		fprintf(stderr, "%s: Not a memleak shared memory segment\n", name);
+		return NULL;
+	}
+
+	if (header->version != MLSHM_VERSION  ||  header->counter_size != sizeof(long)  ||
+		header->header_size + (size_t) header->max_sites * header->site_size > (size_t) st.st_size) {
+		fprintf(stderr, "%s: Unsupported layout version %u\n", name, header->version);
+		return NULL;
+	}
+
+	return header;
+}
+
+
+// Reads a counter summed over the counter slots of a site
+static long
+site_counter(struct mlshm_header const *const header, struct mlshm_site const *const site, uint32_t const offset)
+{
+	char const *const slots = (char const *) site + sizeof(struct mlshm_site);
+	long sum = 0;
+	uint32_t i;
+
+	for (i = 0; i < header->shards; ++i) {
+		sum += __atomic_load_n((long const *) (slots + i * header->shard_size + offset), __ATOMIC_RELAXED);
+	}
+
+	return sum;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does:
+    Reads the counters of all sites in use.
+
+  Wants:
+    header - The segment.
+	sites  - Counters of the previous refresh, replaced by the current ones.
+	elapsed - Seconds since the previous refresh, 0 for the first one.
+
+  Gives:
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+read_sites(struct mlshm_header const *const header, std::vector<site_stats> &sites, double const elapsed)
+{
+	uint32_t const count = __atomic_load_n(&header->nr_sites, __ATOMIC_ACQUIRE);
+	char const *const first = (char const *) header + header->header_size;
+	uint32_t i;
+
+	sites.resize(count);
+
+	for (i = 0; i < count; ++i) {
+		site_stats &stats = sites[i];
+		struct mlshm_site const *const site = (struct mlshm_site const *) (first + (size_t) i * header->site_size);
+		long const est_blocks = site_counter(header, site, header->off_est_blocks);
+		long const allocs     = site_counter(header, site, header->off_allocs);
+
+		// Estimates are there only when sampling
+		if (est_blocks) {
+			stats.blocks = est_blocks / (long) header->est_one;
+			stats.bytes  = site_counter(header, site, header->off_est_bytes);
+		}
+		else {
+			stats.blocks = site_counter(header, site, header->off_blocks);
+			stats.bytes  = site_counter(header, site, header->off_bytes);
+		}
+
+		// Sites are never removed, so a site keeps its index
+		stats.rate   = stats.site && elapsed > 0.0 ? (allocs - stats.allocs) / elapsed : 0.0;
+		stats.site   = site;
+		stats.allocs = allocs;
+	}
+}
+
+
+static void
+usage(char const *const name)
+{
+	fprintf(stderr, "Usage: %s [-d seconds] [-n sites] [-s bytes|blocks|rate] [-1] <pid>\n"
+		"  -d seconds  Refresh interval (default 2)\n"
+		"  -n sites    Number of sites listed (default 20, 0 = all)\n"
+		"  -s key      Sort by live bytes, live blocks or allocation rate\n"
+		"  -1          Print once and exit\n", name);
+}
+
+
+int main(int const argc, char *const argv[])
+{
+	double interval = 2.0;
+	size_t max_sites = 20;
+	bool once = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:s:1h")) != -1) {
+		switch (opt) {
+		case 'd':
+			interval = strtod(optarg, NULL);
+		break;
+
+		case 'n':
+			max_sites = strtoul(optarg, NULL, 0);
+		break;
+
+		case 's':
+			if (!strcmp(optarg, "blocks")) {
+				sort_by = BY_BLOCKS;
+			}
+			else if (!strcmp(optarg, "rate")) {
+				sort_by = BY_RATE;
+			}
+			else {
+				sort_by = BY_BYTES;
+			}
+		break;
+
+		case '1':
+			once = true;
+		break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1  ||  interval <= 0.0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int const pid = atoi(argv[optind]);
+	struct mlshm_header const *const header = attach(pid);
+	bool const clear = !once  &&  isatty(STDOUT_FILENO);
+	std::vector<site_stats> sites;
+	double last = 0.0;
+
+	if (!header) {
+		return 1;
+	}
+
+	// Rates need two readings
+	if (once) {
+		read_sites(header, sites, 0.0);
+		last = now_sec();
+		usleep((useconds_t) (interval * 1e6 < 500000 ? interval * 1e6 : 500000));
+	}
+
+	for (;;) {
+		double const now = now_sec();
+		long total_bytes = 0;
+		long total_blocks = 0;
+		size_t i;
+
+		read_sites(header, sites, last > 0.0 ? now - last : 0.0);
+		last = now;
+
+		std::vector<site_stats> ranked(sites);
+
+		for (i = 0; i < ranked.size(); ++i) {
+			total_bytes  += ranked[i].bytes;
+			total_blocks += ranked[i].blocks;
+		}
+
+		std::sort(ranked.begin(), ranked.end(), site_order);
+
+		size_t const listed = max_sites && max_sites < ranked.size() ? max_sites : ranked.size();
+
+		if (clear) {
+			printf("\033[H\033[2J");
+		}
+
+		printf("memleak-top  pid %u  up %lds  %u sites", header->pid, (long) (time(NULL) - header->start_time),
+			(unsigned int) ranked.size());
+
+		if (header->dropped_sites) {
+			printf(" (%u not shown, segment full)", header->dropped_sites);
+		}
+
+		printf("  %ld bytes in %ld blocks\n\n", total_bytes, total_blocks);
+		printf("%12s %10s %10s %12s  %s\n", "live bytes", "blocks", "allocs/s", "allocs", "site");
+
+		for (i = 0; i < listed; ++i) {
+			site_stats const &stats = ranked[i];
+
+			printf("%12ld %10ld %10.0f %12ld  %.*s\n", stats.bytes, stats.blocks, stats.rate, stats.allocs,
+				(int) sizeof(stats.site->name), stats.site->name);
+		}
+
+		fflush(stdout);
+
+		if (once) {
+			return 0;
+		}
+
+		if (kill(pid, 0)  &&  ESRCH == errno) {
+			char name[32];
+			
+			// Left behind if the process did not exit normally
+			snprintf(name, sizeof(name), MLSHM_NAME_FMT, pid);
+			shm_unlink(name);
+			
+			printf("\nProcess %d has exited\n", pid);
+			return 0;
+		}
+
+		usleep((useconds_t) (interval * 1e6));
+	}
+}
@@ -24,19 +24,41 @@
 #include <stdarg.h>
 #include <time.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+#include <dlfcn.h>
+#include <new>
 #include "memleak.h"
+#include "memleak_events.h"
+#include "memleak_shm.h"
 
 #ifdef SS_ENABLE_MEMTRACE
 
 #define SS_TRACE "Memtrace"
 
 #undef malloc
+#undef calloc
+#undef realloc
+#undef aligned_alloc
+#undef posix_memalign
 #undef free
 #undef new
 
 
 #ifdef SS_MEMTRACE_THREADSAFE
 static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
 
 # define ss_pthread_mutex_lock(x)   pthread_mutex_lock(x)
 # define ss_pthread_mutex_unlock(x) pthread_mutex_unlock(x)
@@ -55,601 +77,4752 @@ unsigned int ss_alloc_max_tolerate = SS_ALLOC_MAX_TOLERATE_DEFAULT;
  * There is a catch in here.
  * The memory allocator system takes a bit of every allocated block for its
  * own use.
- * The main information storage is a sorted linked list where the 
+ * The main information storage is a hash indexed set of records where the 
  * bookkeeping is done. When the application frees memory, it needs a pointer
  * to this information to update the information representing the memory 
  * block. This pointer is stored in the head space of every allocated memory 
- * block. This space is called 'piggyback'.
+ * block. This space is called 'piggyback'. Blocks handed to the C library 
+ * as such, when sampling or not tracking, have no piggyback. The last word
+ * of the piggyback tells the two apart.
  * 
 *****************************************************************************/
 
-// The size of pointer depends on the system. 
-// F.ex. i386 32 bit has 4 byte pointer and 64 bit has 8 byte pointer.
-// #define PIGGYBACK_SIZE (sizeof(void *))
-#define PIGGYBACK_SIZE    12
-
 struct alloc_record;
 
 struct piggyback_data 
 {
 	alloc_record *record;
 	size_t       size;
-} __attribute__ ((packed));
+	void         *block;  // Start of the block from the C library
+#ifdef SS_MEMTRACE_LIFETIMES
+	uint64_t     born;    // Timestamp of the allocation
+#endif
+	int          guard;   // MEML_GUARD_* of the block
+	unsigned int thread;  // ml_thread_id() of the allocating thread
+	uintptr_t    magic;   // PIGGYBACK_MAGIC, right in front of the user's block
+};
 
+// The piggyback is padded to keep the alignment malloc gives, so that the
+// application's block is aligned for any type, SSE/AVX loads included. The
+// padding is at the head, the header ends where the user's block starts.
+// Blocks aligned further have more padding.
+#define PIGGYBACK_ALIGN  __alignof__(max_align_t)
+#define PIGGYBACK_SIZE   ((sizeof(struct piggyback_data) + PIGGYBACK_ALIGN - 1) & ~(PIGGYBACK_ALIGN - 1))
 
-// Pointer to integer cast macro
-#ifdef __x86_64__
-# define PTR_TO_INT_CAST  long long
-# define ALLOC_ALIGN      16
+// Larger than any block the C library hands out (PTRDIFF_MAX), so the size
+// word of its chunk headers is never mistaken for it
+#if UINTPTR_MAX > 0xffffffffUL
+# define PIGGYBACK_MAGIC  ((uintptr_t) 0xa110c8edb10cf00dULL)
 #else
-# define PTR_TO_INT_CAST  long
-# define ALLOC_ALIGN      8
+# define PIGGYBACK_MAGIC  ((uintptr_t) 0xa110c8edUL)
 #endif
 
-#define PTR_TO_TRUEPTR(ptr)    (((char *) ptr) - PIGGYBACK_SIZE)
-#define TRUEPTR_IS_VALID(ptr)  ((PTR_TO_INT_CAST) true_ptr % ALLOC_ALIGN == 0)
+#define block_header(ptr)      (((struct piggyback_data *) (ptr)) - 1)
 
 
-/*
- * I just left the example code for using malloc wrapper
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Tells whether a block was allocated by us. Only the word right in front
+	of the block is read: ours hold PIGGYBACK_MAGIC there, blocks of the C 
+	library the allocator's own chunk header. The magic is cleared when the
+	block is freed.
+  
+  Wants:
+    ptr - The application's pointer, may be NULL.
+	
+  Gives: 
+    The piggyback data of the block, or NULL if the block is not ours.
+----------------------------------------------------------------------------*/
 
-#include <dlfcn.h>
+static inline struct piggyback_data *
+owned_block(void const *const ptr)
+{
+	struct piggyback_data *const pbdata = block_header(ptr);
+	
+	if (!ptr  ||  pbdata->magic != PIGGYBACK_MAGIC) {
+		return NULL;
+	}
+	
+	return pbdata;
+}
 
-void *(*fpmalloc)(size_t);
-static void (*fpfree)(void *);
 
-static void
-resolve_malloc(void)
+/****************************************************************************
+   REAL ALLOCATORS
+*****************************************************************************/
+
+/***** Preload **************************************************************
+ *
+ * With SS_MEMLEAK_PRELOAD memleak is built as a library to be loaded with
+ * LD_PRELOAD. It then replaces malloc and friends of the application, and
+ * needs the C library's allocators for itself. They are looked up with 
+ * dlsym(RTLD_NEXT). dlsym may allocate memory on its own, which is served 
+ * from a small static arena while the lookup is in progress.
+ * 
+ * Memleak itself always allocates through real_*() functions.
+ * 
+*****************************************************************************/
+
+#ifdef SS_MEMLEAK_PRELOAD
+
+// Thread locals of a preloaded library must not allocate on first use
+# define ml_thread  __thread __attribute__ ((tls_model ("initial-exec")))
+
+// Set while memleak is busy with its own bookkeeping. The C library's
+// allocations on our behalf are then passed through untracked.
+static ml_thread bool in_memleak;
+
+# define ml_busy(busy)  (in_memleak = (busy))
+
+typedef void *(*malloc_t)(size_t);
+typedef void  (*free_t)(void *);
+typedef void *(*calloc_t)(size_t, size_t);
+typedef void *(*realloc_t)(void *, size_t);
+typedef int   (*posix_memalign_t)(void **, size_t, size_t);
+typedef size_t (*usable_size_t)(void *);
+
+static malloc_t         libc_malloc;
+static free_t           libc_free;
+static calloc_t         libc_calloc;
+static realloc_t        libc_realloc;
+static posix_memalign_t libc_posix_memalign;
+static usable_size_t    libc_usable_size;
+
+#define BOOTSTRAP_ARENA_SIZE  16384
+
+static char   bootstrap_arena[BOOTSTRAP_ARENA_SIZE] __attribute__ ((aligned (16)));
+static size_t bootstrap_used;
+static bool   resolving;
+
+
+static void *
+bootstrap_alloc(size_t const size)
 {
-	char *error;
-	fpmalloc = (void* (*)(size_t)) dlsym(RTLD_NEXT, "malloc");
-	if (NULL != (error = dlerror())) {
-		fprintf(stderr, "dlsym: %s\n", error);
-		exit(1);
+	size_t const offset = __atomic_fetch_add(&bootstrap_used, (size + 15) & ~(size_t) 15, __ATOMIC_RELAXED);
+	
+	if (offset + size > BOOTSTRAP_ARENA_SIZE) {
+		return NULL;
 	}
-	if (NULL == fpmalloc) {
-		fprintf(stderr, "fpmalloc = NULL\n");
+	
+	return bootstrap_arena + offset;
+}
+
+
+#define is_bootstrap_ptr(ptr) \
+	((char *) (ptr) >= bootstrap_arena  &&  (char *) (ptr) < bootstrap_arena + BOOTSTRAP_ARENA_SIZE)
+
+
+static void *
+resolve(char const *const symbol)
+{
+	void *const fp = dlsym(RTLD_NEXT, symbol);
+	
+	if (NULL == fp) {
+		fprintf(stderr, SS_TRACE ": dlsym %s: %s\n", symbol, dlerror());
 		exit(1);
 	}
+	
+	return fp;
 }
 
+
 static void
-resolve_free(void)
+resolve_allocators(void)
 {
-	char *error;
-	fpfree = (void (*)(void *)) dlsym(RTLD_NEXT, "free");
-	if (NULL != (error = dlerror())) {
-		fprintf(stderr, "dlsym: %s\n", error);
-		exit(1);
+	resolving = true;
+	
+	libc_free           = (free_t) resolve("free");
+	libc_calloc         = (calloc_t) resolve("calloc");
+	libc_realloc        = (realloc_t) resolve("realloc");
+	libc_posix_memalign = (posix_memalign_t) resolve("posix_memalign");
+	libc_usable_size    = (usable_size_t) resolve("malloc_usable_size");
+	__atomic_store_n(&libc_malloc, (malloc_t) resolve("malloc"), __ATOMIC_RELEASE);
+	
+	resolving = false;
+}
+
+
+static inline bool
+allocators_ready(void)
+{
+	if (__builtin_expect(__atomic_load_n(&libc_malloc, __ATOMIC_ACQUIRE) != NULL, 1)) {
+		return true;
 	}
-	if (NULL == fpfree) {
-		fprintf(stderr, "fpfree = NULL\n");
-		exit(1);
+	
+	if (!resolving) {
+		resolve_allocators();
 	}
+	
+	return libc_malloc != NULL;
 }
-*/
 
 
+static void *
+real_malloc(size_t const size)
+{
+	return allocators_ready() ? libc_malloc(size) : bootstrap_alloc(size);
+}
 
-/****************************************************************************
-   LOGGING OPERATIONS
-*****************************************************************************/
+static void *
+real_calloc(size_t const nmemb, size_t const size)
+{
+	// The static arena is zeroed already
+	return allocators_ready() ? libc_calloc(nmemb, size) : bootstrap_alloc(nmemb * size);
+}
+
+static void *
+real_realloc(void *const ptr, size_t const size)
+{
+	return allocators_ready() ? libc_realloc(ptr, size) : NULL;
+}
 
-#ifdef SS_MEMTRACE_LOG_TIMESTAMP
 static void
-ml_log_timestamp(FILE *const Stream)
+real_free(void *const ptr)
 {
-	time_t Time = time(NULL);
-	struct tm *Tm = localtime(&Time);
-	
-	fprintf(Stream, "[%02d%02d%02d:%02d%02d%02d] ", 
-		Tm->tm_year - 100, Tm->tm_mon + 1, Tm->tm_mday,
-		Tm->tm_hour, Tm->tm_min, Tm->tm_sec);
+	if (!is_bootstrap_ptr(ptr)  &&  allocators_ready()) {
+		libc_free(ptr);
+	}
 }
-#endif
 
+static int
+real_posix_memalign(void **const ptr, size_t const alignment, size_t const size)
+{
+	return allocators_ready() ? libc_posix_memalign(ptr, alignment, size) : ENOMEM;
+}
 
-/*---- Function -------------------------------------------------------------
-  Does: 
-    Writes text in the desired output. The output is defined by 
-    SS_MEMTRACE_LOG. Stderr is used in case SS_MEMTRACE_LOG = "".
-    If SS_MEMTRACE_LOG_TIMESTAMP is defined, timestamp is inserted in every
-    line.
-  
-  Wants:
-    Printf-style input.
-	
-  Gives: 
-    Nothing.
-----------------------------------------------------------------------------*/
+static size_t
+real_usable_size(void *const ptr)
+{
+	return allocators_ready() ? libc_usable_size(ptr) : 0;
+}
 
-#ifndef SS_MEMTRACE_LOG
-# define SS_MEMTRACE_LOG ""
-#endif
+#else  // SS_MEMLEAK_PRELOAD
 
-static void
-ml_log(char const *const s, ...)
+# define ml_thread  __thread
+# define ml_busy(busy)  do {} while (0)
+
+# define real_malloc(size)                malloc(size)
+# define real_calloc(nmemb, size)         calloc(nmemb, size)
+# define real_realloc(ptr, size)          realloc(ptr, size)
+# define real_free(ptr)                   free(ptr)
+# define real_posix_memalign(ptr, a, s)   posix_memalign(ptr, a, s)
+
+#endif  // SS_MEMLEAK_PRELOAD
+
+
+// Allocates from the C library, aligned further than malloc if 'align' says
+static void *
+real_alloc(size_t const size, size_t const align)
 {
-	FILE *LogStream = NULL;
-	
-	
-	if (SS_MEMTRACE_LOG[0] != '\0') {
-		LogStream = fopen(SS_MEMTRACE_LOG, "a+");
-		
-		if (!LogStream)
-		{
-			fprintf(stderr, "Opening %s for logging failed!\n", SS_MEMTRACE_LOG);
-			exit(1);
-		}
-	}
-	else {
-		LogStream = stderr;
-	}
-	
-	
-#ifdef SS_MEMTRACE_LOG_TIMESTAMP
-	static bool LineEnd = 1;
+	void *ptr;
 	
-	if (!LineEnd) {
-		LineEnd = strchr(s, '\n') != NULL;
-	}
-	else {
-		ml_log_timestamp(LogStream);
-		LineEnd = strchr(s, '\n') != NULL;
+	if (align <= PIGGYBACK_ALIGN) {
+		return real_malloc(size);
 	}
-#endif
-	
-	va_list args;
-	va_start(args, s);
-	vfprintf(LogStream, s, args);
-	va_end(args);
 	
-	if (SS_MEMTRACE_LOG[0] != '\0') {
-		fclose(LogStream);
-	}
+	return real_posix_memalign(&ptr, align, size) ? NULL : ptr;
 }
 
 
 /****************************************************************************
-   LIST OPERATIONS
+   OUTPUT STREAMS
+*****************************************************************************/
+
+/***** Streams **************************************************************
+ *
+ * Buffered output (asynchronous log and the binary event stream) goes 
+ * through streams. Every thread writes in a ring buffer of its own per 
+ * stream. The rings are single producer, single consumer: only the owner 
+ * thread advances the head and only the drainer advances the tail, so 
+ * neither side locks. A record is published as a whole, so records of 
+ * different threads never mix in the output.
+ * A background thread drains all rings to the stream's file every few 
+ * milliseconds. A producer whose ring is full drains the stream by itself.
+ * The rings of exited threads are handed to new threads once they are 
+ * drained.
+ * 
 *****************************************************************************/
 
+#define STREAM_DRAIN_PERIOD   10    // ms
+#define STREAM_FLUSH_TRIES    1000  // Yields memleak_log_flush() waits for a drainer
 
-struct alloc_record
+struct stream_ring
 {
-	struct alloc_record *next;
-	struct alloc_record *prev;
-	char const *file;
-	int        line;
-	int        cnt;
-	size_t     mem_total;
-	bool       dirty;
-	bool       overallocations;
+	struct stream_ring *next;
+	unsigned long       head;     // Advanced by the owner thread
+	unsigned long       tail;     // Advanced by the drainer
+	bool                orphan;   // Owner thread has exited
+	char                buf[];
 };
 
-struct alloc_list_head
+struct output_stream
 {
-	struct alloc_record *next;
-	struct alloc_record *prev;
+	int                 fd;
+	size_t              ring_size;  // Power of two
+	struct stream_ring *rings;
+	bool                draining;
+	pthread_key_t       ring_key;
 };
 
+enum { STREAM_LOG, STREAM_EVENTS, NR_STREAMS };
 
-static struct alloc_list_head alloc_list =
-	{ (struct alloc_record *) &alloc_list, (struct alloc_record *) &alloc_list };
-
-#define end_of_the_list(list) ((struct alloc_record *) &list)
+static struct output_stream streams[NR_STREAMS];
+static ml_thread struct stream_ring *thread_rings[NR_STREAMS];
+static pthread_once_t stream_writer_once = PTHREAD_ONCE_INIT;
+static bool stream_writer_running;
 
-#define list_for_each(iter, list) \
-	for (iter = list.next; iter != end_of_the_list(list); iter = iter->next)
-
-
-/*---- Function -------------------------------------------------------------
-  Does: 
-    Adds a node in the linked list after the given node.
-  
-  Wants:
-    record - The node to insert.
-	head   - The node in list.
-	
-  Gives: 
-    Nothing.
-----------------------------------------------------------------------------*/
 
-static inline void
-list_add_tail(struct alloc_record *const record, struct alloc_record *const head)
+static void
+fd_write(int const fd, char const *buf, size_t len)
 {
-	head->prev->next = record;
-	record->next     = head;
-	record->prev     = head->prev;
-	head->prev       = record;
+	while (len > 0) {
+		ssize_t const written = write(fd, buf, len);
+		
+		if (written < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return;
+		}
+		
+		buf += written;
+		len -= written;
+	}
 }
 
 
 /*---- Function -------------------------------------------------------------
   Does: 
-    Finds a node related to given file and line. Increments that node's use
-	counter by 1. If such a node is not found, inserts a new one in the list.
+    Writes everything buffered in the rings of a stream to its file. Only 
+	one drainer runs at a time per stream.
   
   Wants:
-    file - The name of the file where memory allocation occured.
-	line - The line, likewise.
+    stream - The stream to drain.
+	wait   - Wait for a running drainer to finish instead of returning.
 	
   Gives: 
-    Pointer to the node of given file and line.
+    false if another drainer was running and wait was not set.
 ----------------------------------------------------------------------------*/
 
-static struct alloc_record *
-list_push_record(char const *const file, int const line, size_t const size, bool const overalloc)
+static bool
+stream_drain(struct output_stream *const stream, bool const wait)
 {
-	struct alloc_record *list_it;
-	int cmp_result;
-
-	ss_pthread_mutex_lock(&rec_lock);
+	struct stream_ring *ring;
+	size_t const mask = stream->ring_size - 1;
 	
-	list_for_each(list_it, alloc_list)
-	{
-		cmp_result = strcmp(list_it->file, file);
-		
-		if (cmp_result > 0) {
-			break;
-		}
-		if (0 == cmp_result  &&  list_it->line > line) {
-			break;
-		}
-		if (0 == cmp_result  &&  line == list_it->line) {
-			
-			if (size > 0) {
-				++list_it->cnt;
-				list_it->mem_total += size;
-			
-				if (overalloc) {
-					list_it->overallocations = true;
-				}
-			}
-			
-			list_it->dirty = true;
-			
-			ss_pthread_mutex_unlock(&rec_lock);
-			return list_it;
+	while (__atomic_test_and_set(&stream->draining, __ATOMIC_ACQUIRE)) {
+		if (!wait) {
+			return false;
 		}
+		sched_yield();
 	}
 	
-	struct alloc_record *const record = (struct alloc_record *) malloc(sizeof(struct alloc_record));
-	
-	if (!record) {
-		ml_log(SS_TRACE ": Failed to allocate memory for list\n");
-		exit(1);
+	for (ring = __atomic_load_n(&stream->rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		unsigned long const head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned long const tail = ring->tail;
+		
+		if (head == tail) {
+			continue;
+		}
+		
+		size_t const start = tail & mask;
+		size_t const len   = head - tail;
+		size_t const first = len < stream->ring_size - start ? len : stream->ring_size - start;
+		
+		fd_write(stream->fd, ring->buf + start, first);
+		fd_write(stream->fd, ring->buf, len - first);
+		
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
 	}
 	
-	record->file      = file;
-	record->line      = line;
-	record->cnt       = size > 0 ? 1 : 0;
-	record->mem_total = size;
-	record->dirty     = true;
-	record->overallocations = false;
+	__atomic_clear(&stream->draining, __ATOMIC_RELEASE);
 	
-	if (overalloc) {
-		record->overallocations = true;
+	return true;
+}
+
+
+static void
+streams_drain(bool const wait)
+{
+	int i;
+	
+	for (i = 0; i < NR_STREAMS; ++i) {
+		if (__atomic_load_n(&streams[i].ring_size, __ATOMIC_ACQUIRE)) {
+			stream_drain(&streams[i], wait);
+		}
 	}
+}
+
+
+static void *
+stream_writer_thread(void *)
+{
+	sigset_t all;
 	
-	list_add_tail(record, list_it);
+	// Signal handlers may flush the streams, so they must not interrupt 
+	// the drain
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
 	
-	ss_pthread_mutex_unlock(&rec_lock);
+	for (;;) {
+		struct timespec const period = { 0, STREAM_DRAIN_PERIOD * 1000000 };
+		
+		nanosleep(&period, NULL);
+		streams_drain(false);
+	}
 	
-	return record;
+	return NULL;
 }
 
 
-struct alloc_record *
-ss_memleak_point_register(char const *const file, int const line)
+static void
+streams_flush_at_exit(void)
 {
-	return list_push_record(file, line, 0, false);
+	streams_drain(true);
 }
 
 
-/****************************************************************************
-   REPORTING OPERATIONS
-*****************************************************************************/
-
-#ifdef SS_ENABLE_MEMTRACE_EXIT
-
-class RecordExitChecker
+static void
+stream_writer_spawn(void)
 {
-public:
-	RecordExitChecker() { }
-	~RecordExitChecker()
-	{
-		struct alloc_record *list_it;
-		
-		ml_log(SS_TRACE ": Application exited\n");
-		ss_pthread_mutex_lock(&rec_lock);
-		
-		list_for_each(list_it, alloc_list)
-		{
-			ml_log(SS_TRACE ": %d unclean records from %s: %d  %s\n", list_it->cnt, list_it->file, list_it->line,
-				list_it->overallocations ? "(OA)" : "");
-		}
-		
-		ss_pthread_mutex_unlock(&rec_lock);
+	pthread_t writer;
+	pthread_attr_t attr;
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	
+	if (pthread_create(&writer, &attr, stream_writer_thread, NULL)) {
+		fprintf(stderr, SS_TRACE ": Failed to start stream writer, writing when buffers fill up\n");
 	}
-};
-
+	else {
+		stream_writer_running = true;
+	}
+	
+	pthread_attr_destroy(&attr);
+}
 
-static RecordExitChecker ExitChecker;
 
-#endif  // SS_ENABLE_MEMTRACE_EXIT
+static void
+stream_writer_start(void)
+{
+	atexit(streams_flush_at_exit);
+	stream_writer_spawn();
+}
 
 
 /*---- Function -------------------------------------------------------------
   Does: 
-    Prints out the current status of alloated memory blocks.
+    Sets the streams up in a forked child. Whatever was buffered before 
+	the fork is the parent's to write, so it is dropped. The rings of the
+	threads left behind in the parent are handed to new threads, and the 
+	writer thread, which is not forked, is started again.
   
   Wants:
-    flags
-	  MEML_TIGHT - All counters in one line.
-	  MEML_SUPPRESS_ZEROS - Do not display zero counters.
-	  MEML_ONLY_CHANGED - Print only changed records.
+    Nothing.
 	
   Gives: 
     Nothing.
 ----------------------------------------------------------------------------*/
 
-void
-memleak_report(int const flags)
+static void
+streams_fork_child(void)
 {
-	const bool tight     = flags & MEML_TIGHT;
-	const bool suppress0 = flags & MEML_SUPPRESS_ZEROS;
-	const bool changed   = flags & MEML_ONLY_CHANGED;
-	struct alloc_record *list_it;
-	
-	
-	if (!tight)  ml_log(SS_TRACE ": %s\n", __FUNCTION__);
-	if (tight)   ml_log(SS_TRACE ": ");
-	
-	ss_pthread_mutex_lock(&rec_lock);
+	struct stream_ring *ring;
+	int i;
 	
-	list_for_each(list_it, alloc_list)
-	{
-		if (changed  &&  !list_it->dirty) {
+	for (i = 0; i < NR_STREAMS; ++i) {
+		if (0 == streams[i].ring_size) {
 			continue;
 		}
 		
-		if (suppress0  &&  0 == list_it->cnt) {
-			continue;
-		}
+		// A drainer of the parent may have been cut short
+		__atomic_clear(&streams[i].draining, __ATOMIC_RELAXED);
 		
-		if (!tight) {
-			ml_log(SS_TRACE ": %4d records, %7lu bytes from line %s: %d  %s\n", list_it->cnt, list_it->mem_total, list_it->file, list_it->line,
-				list_it->overallocations ? "(OA)" : "");
-		}
-		else {
-			ml_log("%d ", list_it->cnt);
+		for (ring = streams[i].rings; ring; ring = ring->next) {
+			ring->tail   = ring->head;
+			ring->orphan = ring != thread_rings[i];
 		}
-		
-		list_it->dirty = false;
 	}
 	
-	ss_pthread_mutex_unlock(&rec_lock);
-	
-	if (tight) ml_log("\n");
+	if (stream_writer_running) {
+		stream_writer_spawn();
+	}
+}
+
+
+static void
+stream_ring_release(void *const ring)
+{
+	__atomic_store_n(&((struct stream_ring *) ring)->orphan, true, __ATOMIC_RELEASE);
 }
 
 
 /*---- Function -------------------------------------------------------------
   Does: 
-    Searches the number of active allocations, made by memleak facility, made 
-	from the same line of code as the given ptr.
+    Sets up a stream writing to the given file descriptor. The background 
+	writer is started with the first stream.
   
   Wants:
-    ptr
-	  A pointer of a memory allocated by memleak facility.
+    id        - STREAM_*
+	fd        - Where the stream is written to.
+	ring_size - Size of per-thread rings, a power of two.
 	
   Gives: 
-    > 0
-	  The number of listed active allocations.
-	-1
-	  The ptr was invalid, ie. not listed by memleak facility.
+    Nothing.
 ----------------------------------------------------------------------------*/
 
-int 
-memleak_allocs_at(void const *const ptr)
+static void
+stream_open(int const id, int const fd, size_t const ring_size)
 {
-	// Get the original allocated address
-	// void *const true_ptr = ((char *) ptr) - PIGGYBACK_SIZE;
-	void const *const true_ptr = PTR_TO_TRUEPTR(ptr);
-	
-	// If the calculated 'true pointer' is divisible by 8 (on 32 bit system) 
-	// or by 16 (on 64 bit system), then this pointer is one mangled by us
-	// if ((PTR_TO_INT_CAST) true_ptr % ALLOC_ALIGN == 0) {
-	if (!TRUEPTR_IS_VALID(true_ptr)) {
-		return -1;
-	}
+	struct output_stream *const stream = &streams[id];
 	
-	struct piggyback_data const *const pbdata = (struct piggyback_data *) true_ptr;
-	struct alloc_record const *const record = pbdata->record;
+	stream->fd = fd;
+	pthread_key_create(&stream->ring_key, stream_ring_release);
+	__atomic_store_n(&stream->ring_size, ring_size, __ATOMIC_RELEASE);
 	
-	return record->cnt;
+	pthread_once(&stream_writer_once, stream_writer_start);
 }
 
 
-/****************************************************************************
-   MEMORY ALLOCATION
-*****************************************************************************/
+static struct stream_ring *
+stream_ring_get(int const id)
+{
+	struct output_stream *const stream = &streams[id];
+	struct stream_ring *ring = thread_rings[id];
+	
+	if (ring) {
+		return ring;
+	}
+	
+	// Adopt a drained ring from an exited thread
+	for (ring = __atomic_load_n(&stream->rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		bool orphan = true;
+		
+		if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head  &&
+			__atomic_compare_exchange_n(&ring->orphan, &orphan, false, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	
+	if (!ring) {
+		ring = (struct stream_ring *) real_malloc(sizeof(struct stream_ring) + stream->ring_size);
+		
+		if (!ring) {
+			return NULL;
+		}
+		
+		ring->head   = 0;
+		ring->tail   = 0;
+		ring->orphan = false;
+		ring->next   = __atomic_load_n(&stream->rings, __ATOMIC_RELAXED);
+		
+		while (!__atomic_compare_exchange_n(&stream->rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+	}
+	
+	pthread_setspecific(stream->ring_key, ring);
+	thread_rings[id] = ring;
+	
+	return ring;
+}
 
 
 /*---- Function -------------------------------------------------------------
   Does: 
-    Allocates memory block whose size is according to application's desire +
-	the size of piggyback block. Updates the bookkeeping and puts the list
-	node's pointer in the head of the allocated block.
+    Appends a record in the calling thread's ring of a stream. The record is
+	published only after it has been copied in full.
   
   Wants:
-    size - The amount of memory the application wants.
-	file - From where it wants it from.
-	line - From where it wants it from.
+    id  - STREAM_*
+	buf - The record.
+	len - The record's length. Must not exceed the ring size.
 	
   Gives: 
-    Pointer to the allocated memory shifted by the size of piggyback block.
+    Nothing.
 ----------------------------------------------------------------------------*/
 
-static void *
-get_memory(size_t const size, char const *const file, int const line)
+static void
+stream_write(int const id, void const *const buf, size_t const len)
 {
-	void *const ptr = malloc(PIGGYBACK_SIZE + size);
-	bool const overalloc = ss_alloc_max_tolerate > 0  &&  size > ss_alloc_max_tolerate;
+	struct output_stream *const stream = &streams[id];
+	struct stream_ring *const ring = stream_ring_get(id);
 	
-	if (overalloc) {
-		ml_log(SS_TRACE ": Allocation size (%u) exceeded tolerance level at %s: %d\n", size, file, line);
+	if (!ring) {
+		fd_write(stream->fd, (char const *) buf, len);
+		return;
 	}
 	
-	if (!ptr) {
-		ml_log(SS_TRACE ": Could not allocate memory at %s: %d\n", file, line);
-		return NULL;
+	while (stream->ring_size - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < len) {
+		stream_drain(stream, true);
 	}
 	
-	struct alloc_record *const record = list_push_record(file, line, size, overalloc);
+	size_t const start = ring->head & (stream->ring_size - 1);
+	size_t const first = len < stream->ring_size - start ? len : stream->ring_size - start;
 	
-	// Store the record's pointer in the head of the allocated memory area
-	struct piggyback_data *const pbdata = (struct piggyback_data *) ptr;
-	pbdata->record = record;
-	pbdata->size   = size;
+	memcpy(ring->buf + start, buf, first);
+	memcpy(ring->buf, (char const *) buf + first, len - first);
 	
-	// Shift the allocated memory area's starting address by the size
-	// of the piggybacked area
-	return ((char *) ptr) + PIGGYBACK_SIZE;
+	__atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
 }
 
 
 /*---- Function -------------------------------------------------------------
   Does: 
-    Checks if the given pointer is allocated by bookkeeper. (This can be 
-	deducted from the alignment.)
-	Updates bookkeeping and frees the memory.
-	The memory is freed even when it's not originally alloated by the book-
-	keeper process.
+    Writes out everything buffered so far, the log and the event stream. 
+	Safe to call from a signal handler to save the output before the 
+	application dies. The signal may have interrupted a drainer, even in 
+	the same thread, so a running drainer is waited for only a while; 
+	then that stream is left as it is.
   
   Wants:
-    ptr - The application's view of the memory it wants freed.
+    Nothing.
 	
   Gives: 
-    True - The memory was originally allocated by the bookkeeper.
-	False - The memory was _not_ originally ...
+    Nothing.
 ----------------------------------------------------------------------------*/
 
-static bool
-free_memory(void *const ptr)
+void
+memleak_log_flush(void)
 {
-	// Get the original allocated address
-	void *const true_ptr = ((char *) ptr) - PIGGYBACK_SIZE;
+	int i, tries;
 	
-	// If the calculated 'true pointer' is divisible by 8 (on 32 bit system) 
-	// or by 16 (on 64 bit system), then this pointer is one mangled by us
-	if ((PTR_TO_INT_CAST) true_ptr % ALLOC_ALIGN == 0) {
-		struct piggyback_data *const pbdata = (struct piggyback_data *) true_ptr;
-		struct alloc_record *const record = pbdata->record;
-		
-		ss_pthread_mutex_lock(&rec_lock);
-		
-		--record->cnt;
-		record->dirty = true;
-		record->mem_total -= pbdata->size;
-		
-		ss_pthread_mutex_unlock(&rec_lock);
-		
-		free(true_ptr);
+	for (i = 0; i < NR_STREAMS; ++i) {
+		if (!__atomic_load_n(&streams[i].ring_size, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
 		
-		return true;
+		for (tries = 0; !stream_drain(&streams[i], false)  &&  tries < STREAM_FLUSH_TRIES; ++tries) {
+			sched_yield();
+		}
 	}
-	
-	// This memory was not allocated by us, but we need to free it anyway
-	free(ptr);
-	return false;
 }
 
 
 /****************************************************************************
-   REPLACEMENT ALLOCATORS
+   LOGGING OPERATIONS
 *****************************************************************************/
 
-void *
-ss_malloc(size_t const size, char const *const file, int const line)
+#ifndef SS_MEMTRACE_LOG
+# define SS_MEMTRACE_LOG ""
+#endif
+
+#ifndef SS_MEMTRACE_LOG_RING
+# define SS_MEMTRACE_LOG_RING  65536
+#endif
+
+// Longest line ml_log() writes, longer ones are truncated
+#define ML_LOG_LINE_MAX  512
+
+
+static int log_fd = -1;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Opens SS_MEMTRACE_LOG once for the lifetime of the process. Stderr is 
+	used in case SS_MEMTRACE_LOG = "". With SS_MEMTRACE_LOG_ASYNC the log 
+	is written through a stream.
+  
+  Wants:
+    Nothing.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+ml_log_open(void)
 {
-	if (!ss_memleak_tracking) {
-		return malloc(size);
+	if (SS_MEMTRACE_LOG[0] == '\0') {
+		log_fd = STDERR_FILENO;
+	}
+	else {
+		log_fd = open(SS_MEMTRACE_LOG, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		
+		if (log_fd < 0) {
+			fprintf(stderr, "Opening %s for logging failed!\n", SS_MEMTRACE_LOG);
+			exit(1);
+		}
 	}
-#ifdef SS_MEMTRACE_VERBOSE
-	ml_log(SS_TRACE ": malloc(%d) from %s: %d\n", size, file, line);
-#endif
 	
-	// void *ptr = get_memory(size, file, line);
-	// return ptr;
-	return get_memory(size, file, line);
+#ifdef SS_MEMTRACE_LOG_ASYNC
+	stream_open(STREAM_LOG, log_fd, SS_MEMTRACE_LOG_RING);
+#endif
 }
 
-void
-ss_free(void *ptr)
+
+#ifdef SS_MEMTRACE_LOG_ASYNC
+# define ml_log_output(buf, len)  stream_write(STREAM_LOG, buf, len)
+#else
+# define ml_log_output(buf, len)  fd_write(log_fd, buf, len)
+#endif
+
+
+#ifdef SS_MEMTRACE_LOG_TIMESTAMP
+static size_t
+ml_log_timestamp(char *const buf)
 {
-	const bool alloc_by_us = free_memory(ptr);
-#ifdef SS_MEMTRACE_VERBOSE
-	if (alloc_by_us) {
-		ml_log(SS_TRACE ": free(%p)\n", ptr);
+	static ml_thread time_t cached_time = -1;
+	static ml_thread char   cached_stamp[64];
+	time_t const Time = time(NULL);
+	
+	// localtime is only needed once a second
+	if (Time != cached_time) {
+		struct tm Tm;
+		
+		localtime_r(&Time, &Tm);
+		snprintf(cached_stamp, sizeof(cached_stamp), "[%02d%02d%02d:%02d%02d%02d] ", 
+			Tm.tm_year - 100, Tm.tm_mon + 1, Tm.tm_mday,
+			Tm.tm_hour, Tm.tm_min, Tm.tm_sec);
+		cached_time = Time;
 	}
-#endif
-	(void) alloc_by_us;
+	
+	size_t const len = strlen(cached_stamp);
+	memcpy(buf, cached_stamp, len);
+	
+	return len;
 }
+#endif
 
-void* 
-operator new (size_t const size, ss_new_t, char const *const file, int const line)
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Writes text in the desired output. The output is defined by 
+    SS_MEMTRACE_LOG. Stderr is used in case SS_MEMTRACE_LOG = "".
+    If SS_MEMTRACE_LOG_TIMESTAMP is defined, timestamp is inserted in every
+    line.
+	The output is opened once and kept open. With SS_MEMTRACE_LOG_ASYNC the 
+	text is buffered and written by a background thread.
+  
+  Wants:
+    Printf-style input.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+ml_log(char const *const s, ...)
 {
-	if (!ss_memleak_tracking) {
-		return malloc(size);
+	char line[ML_LOG_LINE_MAX];
+	size_t len = 0;
+	
+	pthread_once(&log_once, ml_log_open);
+	
+#ifdef SS_MEMTRACE_LOG_TIMESTAMP
+	static ml_thread bool LineEnd = 1;
+	
+	if (LineEnd) {
+		len = ml_log_timestamp(line);
 	}
-#ifdef SS_MEMTRACE_VERBOSE
-	ml_log(SS_TRACE ": new(%d) from %s: %d\n", size, file, line);
+	LineEnd = strchr(s, '\n') != NULL;
 #endif
 	
-	// void *ptr = get_memory(size, file, line);
-	// return ptr;
-	return get_memory(size, file, line);
+	va_list args;
+	va_start(args, s);
+	int const printed = vsnprintf(line + len, sizeof(line) - len, s, args);
+	va_end(args);
+	
+	if (printed < 0) {
+		return;
+	}
+	
+	len += (size_t) printed < sizeof(line) - len ? (size_t) printed : sizeof(line) - len - 1;
+	ml_log_output(line, len);
 }
 
-void
-operator delete (void *const ptr)
+
+/****************************************************************************
+   SITE INDEX OPERATIONS
+*****************************************************************************/
+
+/***** Site index ***********************************************************
+ *
+ * Every allocation site (file + line) has one alloc_record. The records are
+ * indexed by a hash table keyed on the file name *pointer* and the line, so
+ * the same site is found without comparing strings. Records are never 
+ * removed, which lets the lookup walk a bucket chain without taking 
+ * rec_lock. Only inserting a new site takes the lock; the record is fully
+ * initialised before it is published at the head of its chain.
+ * 
+ * All records are also chained in creation order for reporting. Sorted 
+ * order is produced only when a report is printed.
+ * 
+*****************************************************************************/
+
+// Number of hash buckets is 2^SS_MEMTRACE_HASH_BITS
+#ifndef SS_MEMTRACE_HASH_BITS
+# define SS_MEMTRACE_HASH_BITS  12
+#endif
+
+#define SITE_HASH_SIZE  (1 << SS_MEMTRACE_HASH_BITS)
+
+// Number of counter slots per record
+#ifndef SS_MEMTRACE_SHARDS
+# define SS_MEMTRACE_SHARDS  1
+#endif
+
+// Number of log2 size classes counted per record
+#ifndef SS_MEMTRACE_SIZE_CLASSES
+# define SS_MEMTRACE_SIZE_CLASSES  20
+#endif
+
+// Lifetimes are counted in classes of 4x width, the first one below 
+// 2^LIFETIME_SHIFT ticks. The last class holds all longer ones.
+#define LIFETIME_CLASSES  16
+#define LIFETIME_SHIFT    8
+
+#define CACHE_LINE_SIZE  64
+
+// Threads told apart in the matrix of cross-thread frees. The later ones 
+// share the last row and column.
+#ifndef SS_MEMTRACE_THREAD_MATRIX
+# define SS_MEMTRACE_THREAD_MATRIX  16
+#endif
+
+
+/***** Counters *************************************************************
+ *
+ * The counters of a record are split in SS_MEMTRACE_SHARDS slots, each on 
+ * its own cache lines. A thread always updates the same slot, so threads 
+ * don't bounce the same cache line between cores. Slots are updated with 
+ * relaxed atomics, since there may be more threads than slots. Readers sum
+ * up all slots.
+ * 
+*****************************************************************************/
+
+struct alloc_counters
 {
-	const bool alloc_by_us = free_memory(ptr);
-#ifdef SS_MEMTRACE_VERBOSE
-	if (alloc_by_us) {
-		ml_log(SS_TRACE ": delete(%p)\n", ptr);
+	long       cnt;
+	size_t     mem_total;
+	long       est_cnt;    // Estimated blocks in 1/EST_ONE, when sampling
+	long       est_bytes;  // Estimated bytes, when sampling
+	long       allocs;     // Allocations ever made
+	long       size_class[SS_MEMTRACE_SIZE_CLASSES];  // Allocations by log2 of size
+	long       lifetime[LIFETIME_CLASSES];            // Frees by lifetime
+	long       frees;
+	long       cross_frees; // Frees by another thread than the allocating one
+} __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+
+struct alloc_stack;
+
+// A named epoch. Sites have a record of their own in every epoch.
+struct alloc_epoch
+{
+	struct alloc_epoch *next;
+	char const *name;
+	unsigned int id;
+};
+
+struct alloc_record
+{
+	struct alloc_record *hash_next;  // Next record in the same bucket
+	struct alloc_record *all_next;   // Next record in creation order
+	char const *file;
+	int        line;
+	void const *caller;              // Return address, for sites without file
+	struct alloc_stack const *stack; // Call stack, when attributing by stack
+	struct alloc_epoch const *epoch; // Epoch the allocations were made in, or NULL
+	unsigned int id;                 // Site id in the event stream
+	long       rate_allocs;          // Allocations at the previous size class report
+	double     rate_since;           // Time of the previous size class report
+	long       peak_blocks;          // Most live blocks seen by the watcher and reports
+	long       peak_bytes;           // Most live bytes, likewise
+	long       watch_bytes;          // Live bytes at the watcher's previous poll
+	unsigned int alarms;             // Watermarks exceeded, owned by the watcher
+	int        guard;                // MEML_GUARD_* of new blocks
+	long       overruns;             // Overruns found by guards
+	bool       dirty;
+	bool       overallocations;
+	struct alloc_counters *shard;    // SS_MEMTRACE_SHARDS slots, following the 
+	                                 // record or in the shared segment
+} __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+
+static struct alloc_record *site_hash[SITE_HASH_SIZE];
+static struct alloc_record *all_records;
+static unsigned int        nr_records;
+
+#define record_load(ptr)        __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+#define record_publish(ptr, r)  __atomic_store_n(&(ptr), r, __ATOMIC_RELEASE)
+
+#define list_for_each(iter) \
+	for (iter = record_load(all_records); iter; iter = iter->all_next)
+
+
+static inline unsigned int
+site_hash_index(char const *const file, int const line, void const *const caller, struct alloc_stack const *const stack,
+	struct alloc_epoch const *const epoch)
+{
+	unsigned long long key = (unsigned long long) (unsigned long) file ^ (unsigned long) caller ^ ((unsigned long) stack >> 4) ^
+		((unsigned long long) (unsigned long) epoch << 16);
+	
+	key ^= (unsigned long long) (unsigned int) line << 32;
+	key *= 0x9e3779b97f4a7c15ULL;
+	
+	return (unsigned int) (key >> (64 - SS_MEMTRACE_HASH_BITS));
+}
+
+
+static inline struct alloc_record *
+site_lookup(struct alloc_record *const head, char const *const file, int const line, void const *const caller, 
+	struct alloc_stack const *const stack, struct alloc_epoch const *const epoch)
+{
+	struct alloc_record *rec_it;
+	
+	for (rec_it = head; rec_it; rec_it = rec_it->hash_next) {
+		if (rec_it->file == file  &&  rec_it->line == line  &&  rec_it->caller == caller  &&  rec_it->stack == stack  &&
+			rec_it->epoch == epoch) {
+			return rec_it;
+		}
 	}
-#endif
-	(void) alloc_by_us;
+	
+	return NULL;
 }
 
-void *
-operator new [] (size_t const size, ss_new_t, char const *const file, int const line)
+
+/****************************************************************************
+   COUNTER OPERATIONS
+*****************************************************************************/
+
+static unsigned int next_thread_id;
+static ml_thread unsigned int thread_id;
+static ml_thread int thread_shard = -1;
+
+
+// Small sequential id of the calling thread, starting from 1
+static inline unsigned int
+ml_thread_id(void)
 {
-	if (!ss_memleak_tracking) {
-		return malloc(size);
+	if (__builtin_expect(0 == thread_id, 0)) {
+		thread_id = __atomic_add_fetch(&next_thread_id, 1, __ATOMIC_RELAXED);
 	}
-#ifdef SS_MEMTRACE_VERBOSE
-	ml_log(SS_TRACE ": new[](%d) from %s: %d\n", size, file, line);
-#endif
 	
-	// void *ptr = get_memory(size, file, line);
-	// return ptr;
-	return get_memory(size, file, line);
+	return thread_id;
 }
 
-void
-operator delete [] (void *const ptr)
+
+static bool shm_child_pending;
+static void shm_child(void);
+
+
+static inline struct alloc_counters *
+record_shard(struct alloc_record *const record)
 {
-	const bool alloc_by_us = free_memory(ptr);
-#ifdef SS_MEMTRACE_VERBOSE
-	if (alloc_by_us) {
-		ml_log(SS_TRACE ": delete[](%p)\n", ptr);
+	// A forked child gets a segment of its own before it counts anything
+	if (__builtin_expect(shm_child_pending, 0)) {
+		shm_child();
 	}
-#endif
-	(void) alloc_by_us;
+	
+	if (__builtin_expect(thread_shard < 0, 0)) {
+		thread_shard = (ml_thread_id() - 1) % SS_MEMTRACE_SHARDS;
+	}
+	
+	return &record->shard[thread_shard];
 }
 
+
+static inline void
+record_count(struct alloc_record *const record, long const cnt, long const size)
+{
+	struct alloc_counters *const counters = record_shard(record);
+	
+	__atomic_fetch_add(&counters->cnt, cnt, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters->mem_total, size, __ATOMIC_RELAXED);
+	
+	if (!__atomic_load_n(&record->dirty, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&record->dirty, true, __ATOMIC_RELAXED);
+	}
+}
+
+
+// Raises a peak to 'value' if it is higher
+static inline void
+atomic_max(long *const peak, long const value)
+{
+	long old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+	
+	while (value > old  &&  !__atomic_compare_exchange_n(peak, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+
+// Size class of a block: 0 for empty blocks, n for 2^(n-1) <= size < 2^n
+static inline int
+size_class(size_t const size)
+{
+	int const cls = size ? (int) (sizeof(long) * 8) - __builtin_clzl(size) : 0;
+	
+	return cls < SS_MEMTRACE_SIZE_CLASSES ? cls : SS_MEMTRACE_SIZE_CLASSES - 1;
+}
+
+
+// Lifetime class of a block that lived 'ticks'
+static inline int
+lifetime_class(uint64_t const ticks)
+{
+	int const cls = ticks >> LIFETIME_SHIFT ? (64 - __builtin_clzll(ticks >> LIFETIME_SHIFT) + 1) / 2 : 0;
+	
+	return cls < LIFETIME_CLASSES ? cls : LIFETIME_CLASSES - 1;
+}
+
+
+// Upper bound in ticks of a lifetime class
+#define lifetime_class_limit(cls)  (1ULL << (LIFETIME_SHIFT + 2 * (cls)))
+
+
+static inline void
+record_count_lifetime(struct alloc_record *const record, uint64_t const ticks)
+{
+	__atomic_fetch_add(&record_shard(record)->lifetime[lifetime_class(ticks)], 1, __ATOMIC_RELAXED);
+}
+
+
+/***** Thread matrix *******************************************************
+ *
+ * Frees are counted by the thread that allocated the block (producer) and 
+ * the one freeing it (consumer). A consumer only updates its own row, so 
+ * the rows don't bounce between cores. The consumers counted together in 
+ * the last row update one of its shards, as the counters of a site. Sites
+ * count their cross-thread frees apart.
+ * 
+*****************************************************************************/
+
+struct thread_row
+{
+	long producer[SS_MEMTRACE_THREAD_MATRIX];
+} __attribute__ ((aligned (CACHE_LINE_SIZE)));
+
+static struct thread_row thread_frees[SS_MEMTRACE_THREAD_MATRIX - 1];  // By consumer
+static struct thread_row thread_frees_later[SS_MEMTRACE_SHARDS];       // Last row by thread_shard
+
+
+// Row or column of a thread in the matrix
+static inline unsigned int
+thread_slot(unsigned int const id)
+{
+	return id <= SS_MEMTRACE_THREAD_MATRIX ? id - 1 : SS_MEMTRACE_THREAD_MATRIX - 1;
+}
+
+
+// Counts a free of a block allocated by thread 'producer'
+static inline void
+record_count_free(struct alloc_record *const record, unsigned int const producer)
+{
+	struct alloc_counters *const counters = record_shard(record);
+	unsigned int const consumer = ml_thread_id();
+	
+	__atomic_fetch_add(&counters->frees, 1, __ATOMIC_RELAXED);
+	
+	if (producer != consumer) {
+		__atomic_fetch_add(&counters->cross_frees, 1, __ATOMIC_RELAXED);
+	}
+	
+	// thread_shard is set by record_shard()
+	struct thread_row *const row = consumer < SS_MEMTRACE_THREAD_MATRIX ? 
+		&thread_frees[consumer - 1] : &thread_frees_later[thread_shard];
+	
+	__atomic_fetch_add(&row->producer[thread_slot(producer)], 1, __ATOMIC_RELAXED);
+}
+
+
+// Counts a new allocation in the allocation rate and its size class
+static inline void
+record_count_alloc(struct alloc_record *const record, size_t const size)
+{
+	struct alloc_counters *const counters = record_shard(record);
+	
+	__atomic_fetch_add(&counters->allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters->size_class[size_class(size)], 1, __ATOMIC_RELAXED);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Sums up the counter slots of a record.
+  
+  Wants:
+    record - The record to read.
+	sum    - Where to store the totals.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+record_sum(struct alloc_record const *const record, struct alloc_counters *const sum)
+{
+	int i;
+	
+	memset(sum, 0, sizeof(*sum));
+	
+	for (i = 0; i < SS_MEMTRACE_SHARDS; ++i) {
+		struct alloc_counters const *const shard = &record->shard[i];
+		int k;
+		
+		sum->cnt       += __atomic_load_n(&shard->cnt, __ATOMIC_RELAXED);
+		sum->mem_total += __atomic_load_n(&shard->mem_total, __ATOMIC_RELAXED);
+		sum->est_cnt   += __atomic_load_n(&shard->est_cnt, __ATOMIC_RELAXED);
+		sum->est_bytes += __atomic_load_n(&shard->est_bytes, __ATOMIC_RELAXED);
+		sum->allocs    += __atomic_load_n(&shard->allocs, __ATOMIC_RELAXED);
+		sum->frees     += __atomic_load_n(&shard->frees, __ATOMIC_RELAXED);
+		sum->cross_frees += __atomic_load_n(&shard->cross_frees, __ATOMIC_RELAXED);
+		
+		for (k = 0; k < SS_MEMTRACE_SIZE_CLASSES; ++k) {
+			sum->size_class[k] += __atomic_load_n(&shard->size_class[k], __ATOMIC_RELAXED);
+		}
+		for (k = 0; k < LIFETIME_CLASSES; ++k) {
+			sum->lifetime[k] += __atomic_load_n(&shard->lifetime[k], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+static bool events_on;
+static void event_emit_site(struct alloc_record const *record);
+static struct alloc_counters *shm_site_reserve(void);
+static void shm_site_publish(struct alloc_record const *record);
+static int  guard_site_mode(char const *file, int line);
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Finds the record of given file and line. If such a record is not found,
+	inserts a new one in the index.
+	Existing records are found without locking.
+  
+  Wants:
+    file   - The name of the file where memory allocation occured.
+	line   - The line, likewise.
+	caller - Return address of the allocation, when there's no file.
+	stack  - Call stack of the allocation, or NULL.
+	epoch  - Epoch of the allocation, or NULL.
+	
+  Gives: 
+    Pointer to the record of given file and line.
+----------------------------------------------------------------------------*/
+
+static struct alloc_record *
+site_find_or_add(char const *const file, int const line, void const *const caller, struct alloc_stack const *const stack,
+	struct alloc_epoch const *const epoch)
+{
+	struct alloc_record **const bucket = &site_hash[site_hash_index(file, line, caller, stack, epoch)];
+	struct alloc_record *record = site_lookup(record_load(*bucket), file, line, caller, stack, epoch);
+	
+	if (record) {
+		return record;
+	}
+	
+	ss_pthread_mutex_lock(&rec_lock);
+	
+	// Somebody may have added the same site while we waited for the lock
+	record = site_lookup(*bucket, file, line, caller, stack, epoch);
+	
+	if (!record) {
+		struct alloc_counters *const shared = shm_site_reserve();
+		size_t const size = sizeof(struct alloc_record) + (shared ? 0 : SS_MEMTRACE_SHARDS * sizeof(struct alloc_counters));
+		void *mem;
+		
+		if (real_posix_memalign(&mem, CACHE_LINE_SIZE, size)) {
+			ml_log(SS_TRACE ": Failed to allocate memory for list\n");
+			exit(1);
+		}
+		
+		record = (struct alloc_record *) memset(mem, 0, size);
+		record->shard     = shared ? shared : (struct alloc_counters *) (record + 1);
+		record->file      = file;
+		record->line      = line;
+		record->caller    = caller;
+		record->stack     = stack;
+		record->epoch     = epoch;
+		record->dirty     = true;
+		record->overallocations = false;
+		record->guard     = guard_site_mode(file, line);
+		
+		record->id        = __atomic_add_fetch(&nr_records, 1, __ATOMIC_RELAXED);
+		
+		if (shared) {
+			shm_site_publish(record);
+		}
+		
+		record->all_next  = all_records;
+		record->hash_next = *bucket;
+		record_publish(all_records, record);
+		record_publish(*bucket, record);
+		
+		if (__atomic_load_n(&events_on, __ATOMIC_ACQUIRE)) {
+			event_emit_site(record);
+		}
+	}
+	
+	ss_pthread_mutex_unlock(&rec_lock);
+	
+	return record;
+}
+
+
+static int
+record_compare(void const *const a, void const *const b)
+{
+	struct alloc_record const *const rec_a = *(struct alloc_record * const *) a;
+	struct alloc_record const *const rec_b = *(struct alloc_record * const *) b;
+	
+	// Epochs are listed one after another, sites of no epoch first
+	if (rec_a->epoch != rec_b->epoch) {
+		unsigned int const id_a = rec_a->epoch ? rec_a->epoch->id : 0;
+		unsigned int const id_b = rec_b->epoch ? rec_b->epoch->id : 0;
+		
+		return id_a < id_b ? -1 : 1;
+	}
+	
+	// Sites without file come last, in address order
+	if (!rec_a->file  ||  !rec_b->file) {
+		if (rec_a->file != rec_b->file) {
+			return rec_a->file ? -1 : 1;
+		}
+		if (rec_a->caller != rec_b->caller) {
+			return rec_a->caller < rec_b->caller ? -1 : 1;
+		}
+		return rec_a->stack < rec_b->stack ? -1 : rec_a->stack > rec_b->stack;
+	}
+	
+	int const cmp_result = strcmp(rec_a->file, rec_b->file);
+	
+	if (cmp_result != 0) {
+		return cmp_result;
+	}
+	
+	if (rec_a->line != rec_b->line) {
+		return rec_a->line - rec_b->line;
+	}
+	
+	return rec_a->stack < rec_b->stack ? -1 : rec_a->stack > rec_b->stack;
+}
+
+
+// Longest site name printed
+#define SITE_NAME_MAX  256
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Formats a code address as "object(symbol+offset) [address]". Falls back
+	to "[address]" when the address can't be resolved.
+  
+  Wants:
+    pc   - The code address.
+	buf  - Where to write the name.
+	size - Size of buf.
+	
+  Gives: 
+    buf
+----------------------------------------------------------------------------*/
+
+static char const *
+pc_name(void const *const pc, char *const buf, size_t const size)
+{
+	Dl_info info;
+	
+	if (dladdr(pc, &info)  &&  info.dli_fname) {
+		char const *const slash  = strrchr(info.dli_fname, '/');
+		char const *const object = slash ? slash + 1 : info.dli_fname;
+		
+		if (info.dli_sname) {
+			snprintf(buf, size, "%s(%s+0x%lx) [%p]", object, info.dli_sname, 
+				(unsigned long) ((char const *) pc - (char const *) info.dli_saddr), pc);
+		}
+		else {
+			snprintf(buf, size, "%s(+0x%lx) [%p]", object, 
+				(unsigned long) ((char const *) pc - (char const *) info.dli_fbase), pc);
+		}
+		return buf;
+	}
+	
+	snprintf(buf, size, "[%p]", pc);
+	return buf;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Formats the name of an allocation site: "file: line", or for sites 
+	identified by return address "object(symbol+offset) [address]". 
+	Sites of an epoch are followed by " [epoch]".
+  
+  Wants:
+    record - The site.
+	buf    - Where to write the name.
+	size   - Size of buf.
+	
+  Gives: 
+    buf
+----------------------------------------------------------------------------*/
+
+static char const *
+site_name(struct alloc_record const *const record, char *const buf, size_t const size)
+{
+	if (record->file) {
+		snprintf(buf, size, "%s: %d", record->file, record->line);
+	}
+	else {
+		pc_name(record->caller, buf, size);
+	}
+	
+	if (record->epoch) {
+		size_t const len = strlen(buf);
+		
+		snprintf(buf + len, size - len, " [%s]", record->epoch->name);
+	}
+	
+	return buf;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Resolves the record of an allocation site. The allocation macros call 
+	this once per expansion and keep the result in a function-local static,
+	so later allocations from the same site skip the lookup altogether.
+  
+  Wants:
+    file - The name of the file where memory allocation occurs.
+	line - The line, likewise.
+	
+  Gives: 
+    Pointer to the record of given file and line.
+----------------------------------------------------------------------------*/
+
+struct alloc_record *
+ss_memleak_point_register(char const *const file, int const line)
+{
+	return site_find_or_add(file, line, NULL, NULL, NULL);
+}
+
+
+/****************************************************************************
+   STACK TABLE
+*****************************************************************************/
+
+/***** Stack attribution ****************************************************
+ *
+ * With ss_memleak_stack_depth > 0 sites are keyed also by the call stack of
+ * the allocation, so allocations through wrappers and containers are told
+ * apart by their real callers. The stack is the top return addresses, 
+ * taken by following the frame pointer chain. Nothing is symbolized when
+ * allocating; reports resolve the addresses with dladdr().
+ * Identical stacks are stored once in a hash table and a site refers to its
+ * stack by address. Like records, stacks are never freed.
+ * 
+ * A frame pointer is followed only when it's aligned, above the previous 
+ * one and inside the thread's stack, whose bounds are looked up once per 
+ * thread. Code built without frame pointers (-fomit-frame-pointer, the 
+ * default with -O2 on many targets) cuts the stack short, but never makes
+ * us read outside the stack. Build with -fno-omit-frame-pointer.
+ * 
+*****************************************************************************/
+
+unsigned int ss_memleak_stack_depth = SS_MEMTRACE_STACK_DEPTH_DEFAULT;
+
+#define STACK_HASH_SIZE  (1 << SS_MEMTRACE_HASH_BITS)
+
+struct alloc_stack
+{
+	struct alloc_stack *hash_next;
+	unsigned long long hash;
+	unsigned int       depth;
+	void const         *pc[SS_MEMTRACE_STACK_MAX];  // Only 'depth' allocated
+};
+
+static struct alloc_stack *stack_hash[STACK_HASH_SIZE];
+
+static ml_thread char const *stack_low;
+static ml_thread char const *stack_high;
+
+
+// Looks up the bounds of the calling thread's stack once
+static bool
+stack_bounds(void)
+{
+	if (__builtin_expect(NULL == stack_high, 0)) {
+		pthread_attr_t attr;
+		void *addr = NULL;
+		size_t size = 0;
+		
+		if (0 == pthread_getattr_np(pthread_self(), &attr)) {
+			pthread_attr_getstack(&attr, &addr, &size);
+			pthread_attr_destroy(&attr);
+		}
+		
+		// An empty range, when unknown
+		stack_low  = (char const *) addr + (addr ? 0 : 1);
+		stack_high = (char const *) addr + size + (addr ? 0 : 1);
+	}
+	
+	return stack_high > stack_low;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Walks the frame pointer chain up from the given frame and collects the
+	return addresses.
+  
+  Wants:
+    frame - Frame address of the allocator the application called.
+	pc    - Where to store the return addresses, innermost first.
+	max   - Size of pc.
+	
+  Gives: 
+    The number of return addresses stored.
+----------------------------------------------------------------------------*/
+
+static unsigned int
+stack_walk(void const *const frame, void const **const pc, unsigned int const max)
+{
+	unsigned int depth = 0;
+	
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+	// Every frame starts with the caller's frame pointer and return address
+	void *const *fp = (void *const *) frame;
+	
+	if (!stack_bounds()) {
+		return 0;
+	}
+	
+	// Compared as integers, fp + 2 would wrap for a garbage fp near the top
+	uintptr_t const low  = (uintptr_t) stack_low;
+	uintptr_t const high = (uintptr_t) stack_high - 2 * sizeof(void *);
+	
+	while (depth < max  &&  (uintptr_t) fp >= low  &&  (uintptr_t) fp <= high  &&  
+		0 == ((uintptr_t) fp & (sizeof(void *) - 1)))
+	{
+		void *const *const next = (void *const *) fp[0];
+		
+		if (!fp[1]) {
+			break;
+		}
+		
+		pc[depth++] = fp[1];
+		
+		if (next <= fp) {
+			break;
+		}
+		
+		fp = next;
+	}
+#endif
+	
+	return depth;
+}
+
+
+static inline struct alloc_stack *
+stack_lookup(struct alloc_stack *const head, unsigned long long const hash, void const *const *const pc, 
+	unsigned int const depth)
+{
+	struct alloc_stack *stack_it;
+	
+	for (stack_it = head; stack_it; stack_it = stack_it->hash_next) {
+		if (stack_it->hash == hash  &&  stack_it->depth == depth  &&  
+			0 == memcmp(stack_it->pc, pc, depth * sizeof(void *))) {
+			return stack_it;
+		}
+	}
+	
+	return NULL;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Captures the call stack of an allocation and finds its copy in the stack
+	table. Unknown stacks are added. Known stacks are found without locking.
+  
+  Wants:
+    frame - Frame address of the allocator the application called.
+	
+  Gives: 
+    The stack, or NULL if no frames could be captured.
+----------------------------------------------------------------------------*/
+
+static struct alloc_stack const *
+stack_capture(void const *const frame)
+{
+	void const *pc[SS_MEMTRACE_STACK_MAX];
+	unsigned int depth = __atomic_load_n(&ss_memleak_stack_depth, __ATOMIC_RELAXED);
+	unsigned long long hash;
+	unsigned int i;
+	
+	depth = stack_walk(frame, pc, depth < SS_MEMTRACE_STACK_MAX ? depth : SS_MEMTRACE_STACK_MAX);
+	
+	if (0 == depth) {
+		return NULL;
+	}
+	
+	hash = depth;
+	
+	for (i = 0; i < depth; ++i) {
+		hash = (hash ^ (unsigned long) pc[i]) * 0x9e3779b97f4a7c15ULL;
+	}
+	
+	struct alloc_stack **const bucket = &stack_hash[hash >> (64 - SS_MEMTRACE_HASH_BITS)];
+	struct alloc_stack *stack = stack_lookup(record_load(*bucket), hash, pc, depth);
+	
+	if (stack) {
+		return stack;
+	}
+	
+	ss_pthread_mutex_lock(&rec_lock);
+	
+	stack = stack_lookup(*bucket, hash, pc, depth);
+	
+	if (!stack) {
+		stack = (struct alloc_stack *) real_malloc(offsetof(struct alloc_stack, pc) + depth * sizeof(void *));
+		
+		if (stack) {
+			stack->hash  = hash;
+			stack->depth = depth;
+			memcpy(stack->pc, pc, depth * sizeof(void *));
+			
+			stack->hash_next = *bucket;
+			record_publish(*bucket, stack);
+		}
+	}
+	
+	ss_pthread_mutex_unlock(&rec_lock);
+	
+	return stack;
+}
+
+
+// Prints the frames of a site's stack, symbolized
+static void
+stack_report(struct alloc_stack const *const stack)
+{
+	char name[SITE_NAME_MAX];
+	unsigned int i;
+	
+	for (i = 0; i < stack->depth; ++i) {
+		ml_log(SS_TRACE ":        #%-2u %s\n", i, pc_name(stack->pc[i], name, sizeof(name)));
+	}
+}
+
+
+/****************************************************************************
+   EVENT STREAM
+*****************************************************************************/
+
+/***** Event stream *********************************************************
+ *
+ * Optionally every tracked allocation and free is recorded as a fixed size
+ * binary event (see memleak_events.h) through a stream. Recording an event
+ * is a timestamp read and a 32 byte copy to the thread's own ring. The 
+ * events are analyzed offline by memleak-analyze.
+ * On x86 timestamps are raw TSC ticks, calibrated once when the stream is 
+ * opened.
+ * 
+*****************************************************************************/
+
+#ifndef SS_MEMTRACE_EVENT_RING
+# define SS_MEMTRACE_EVENT_RING  262144
+#endif
+
+// Longest site name recorded in the event stream
+#define EVENT_SITE_NAME_MAX  1024
+
+
+static inline uint64_t
+event_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+static uint64_t
+event_ticks_per_sec(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec begin, end;
+	struct timespec const wait = { 0, 20000000 };
+	uint64_t const ticks_begin = (clock_gettime(CLOCK_MONOTONIC, &begin), __rdtsc());
+	
+	nanosleep(&wait, NULL);
+	
+	uint64_t const ticks_end = (clock_gettime(CLOCK_MONOTONIC, &end), __rdtsc());
+	uint64_t const ns = (end.tv_sec - begin.tv_sec) * 1000000000ULL + end.tv_nsec - begin.tv_nsec;
+	
+	return (ticks_end - ticks_begin) * 1000000000ULL / ns;
+#else
+	return 1000000000ULL;
+#endif
+}
+
+
+static inline void
+event_emit(uint8_t const type, struct alloc_record const *const record, void const *const ptr, size_t const size)
+{
+	struct mlev_event event;
+	
+	event.ticks    = event_ticks();
+	event.address  = (uint64_t) (uintptr_t) ptr;
+	event.size     = size;
+	event.site     = record->id;
+	event.thread   = (uint16_t) ml_thread_id();
+	event.type     = type;
+	event.reserved = 0;
+	
+	stream_write(STREAM_EVENTS, &event, sizeof(event));
+}
+
+
+static void
+event_emit_site(struct alloc_record const *const record)
+{
+	union {
+		struct mlev_event event;
+		char buf[sizeof(struct mlev_event) + EVENT_SITE_NAME_MAX];
+	} site;
+	char caller_name[SITE_NAME_MAX];
+	char const *const name = record->file ? record->file : site_name(record, caller_name, sizeof(caller_name));
+	size_t name_len = strlen(name);
+	
+	if (name_len > EVENT_SITE_NAME_MAX - 8) {
+		name_len = EVENT_SITE_NAME_MAX - 8;
+	}
+	
+	size_t const padded_len = (name_len + 7) & ~(size_t) 7;
+	
+	memset(&site, 0, sizeof(site.event) + padded_len);
+	site.event.ticks   = event_ticks();
+	site.event.address = name_len;
+	site.event.size    = record->line;
+	site.event.site    = record->id;
+	site.event.thread  = (uint16_t) ml_thread_id();
+	site.event.type    = MLEV_SITE;
+	memcpy(site.buf + sizeof(site.event), name, name_len);
+	
+	stream_write(STREAM_EVENTS, &site, sizeof(site.event) + padded_len);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Starts recording allocation and free events in a file. The sites known
+	so far are written first. Can be called once per process.
+  
+  Wants:
+    path - The file to write. An existing file is truncated.
+	
+  Gives: 
+    0 on success, -1 if the file couldn't be opened or events are already 
+	being recorded.
+----------------------------------------------------------------------------*/
+
+int
+memleak_events_open(char const *const path)
+{
+	static bool opened;
+	struct mlev_header header;
+	struct alloc_record *list_it;
+	
+	if (__atomic_test_and_set(&opened, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	
+	int const fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	
+	if (fd < 0) {
+		ml_log(SS_TRACE ": Opening %s for events failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MLEV_MAGIC, sizeof(header.magic));
+	header.version       = MLEV_VERSION;
+	header.event_size    = sizeof(struct mlev_event);
+	header.ticks_per_sec = event_ticks_per_sec();
+	header.start_ticks   = event_ticks();
+	fd_write(fd, (char const *) &header, sizeof(header));
+	
+	stream_open(STREAM_EVENTS, fd, SS_MEMTRACE_EVENT_RING);
+	
+	// A site created meanwhile may be written twice, the analyzer copes
+	__atomic_store_n(&events_on, true, __ATOMIC_RELEASE);
+	
+	list_for_each(list_it)
+	{
+		event_emit_site(list_it);
+	}
+	
+	return 0;
+}
+
+
+#ifdef SS_MEMTRACE_EVENTS
+class EventStreamOpener
+{
+public:
+	EventStreamOpener() { memleak_events_open(SS_MEMTRACE_EVENTS); }
+};
+
+static EventStreamOpener EventOpener;
+#endif
+
+
+/****************************************************************************
+   SAMPLING
+*****************************************************************************/
+
+/***** Sampling *************************************************************
+ *
+ * With ss_memleak_sample_period > 0 only a sample of the allocations is 
+ * tracked, like tcmalloc's heap profiler does. Every thread counts down the
+ * bytes it allocates. When the count runs out the allocation is sampled and
+ * a new count is drawn from an exponential distribution whose mean is the 
+ * period. So an allocation of 'size' bytes is sampled with probability 
+ * 1 - exp(-size / period), and every sampled block stands for 
+ * 1 / (1 - exp(-size / period)) blocks. Reports scale the counters up by 
+ * that weight.
+ * Unsampled allocations get no piggyback block, no site lookup (in preload 
+ * mode) and cost only the countdown.
+ * The weight of a freed block is calculated with the current period, so 
+ * change the period only before tracking is enabled.
+ * 
+*****************************************************************************/
+
+unsigned long ss_memleak_sample_period = SS_MEMTRACE_SAMPLE_PERIOD_DEFAULT;
+
+#define EST_ONE  256  // Fixed point one of estimated block counts
+
+static ml_thread long     bytes_until_sample;
+static ml_thread uint64_t sample_state;
+
+
+static uint64_t
+sample_random(void)
+{
+	if (__builtin_expect(0 == sample_state, 0)) {
+		struct timespec ts;
+		
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		sample_state = (ts.tv_nsec ^ ((uint64_t) ml_thread_id() << 32)) | 1;
+	}
+	
+	// xorshift64*
+	sample_state ^= sample_state >> 12;
+	sample_state ^= sample_state << 25;
+	sample_state ^= sample_state >> 27;
+	
+	return sample_state * 0x2545f4914f6cdd1dULL;
+}
+
+
+static inline bool
+sample_skip(size_t const size)
+{
+	unsigned long const period = __atomic_load_n(&ss_memleak_sample_period, __ATOMIC_RELAXED);
+	
+	if (__builtin_expect(0 == period, 1)) {
+		return false;
+	}
+	
+	bytes_until_sample -= size;
+	
+	if (bytes_until_sample > 0) {
+		return true;
+	}
+	
+	// Uniform in (0, 1]
+	double const u = ((sample_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+	
+	bytes_until_sample = (long) (-log(u) * period) + 1;
+	
+	return false;
+}
+
+
+// Counts a sampled block in the estimates. Gives the number of blocks it stands for.
+static double
+record_count_sample(struct alloc_record *const record, int const sign, size_t const size)
+{
+	unsigned long const period = __atomic_load_n(&ss_memleak_sample_period, __ATOMIC_RELAXED);
+	
+	if (0 == period) {
+		return 1.0;
+	}
+	
+	double const probability = size > 0 ? 1.0 - exp(-(double) size / period) : 1.0;
+	double const weight = 1.0 / probability;
+	struct alloc_counters *const counters = record_shard(record);
+	
+	__atomic_fetch_add(&counters->est_cnt, sign * (long) (weight * EST_ONE + 0.5), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters->est_bytes, sign * (long) (weight * size + 0.5), __ATOMIC_RELAXED);
+	
+	return weight;
+}
+
+
+// Scales summed counters up to the estimated totals when sampling
+static void
+record_estimate(struct alloc_counters const *const sum, long *const cnt, size_t *const bytes)
+{
+	if (0 == __atomic_load_n(&ss_memleak_sample_period, __ATOMIC_RELAXED)) {
+		*cnt   = sum->cnt;
+		*bytes = sum->mem_total;
+		return;
+	}
+	
+	*cnt   = (sum->est_cnt + EST_ONE / 2) / EST_ONE;
+	*bytes = sum->est_bytes;
+}
+
+
+/****************************************************************************
+   SHARED STATS
+*****************************************************************************/
+
+/***** Shared stats *********************************************************
+ *
+ * After memleak_shm_open() the counters of new sites are kept in a shared 
+ * memory segment (layout in memleak_shm.h) instead of after their records.
+ * Allocations update them just the same, and other processes, f.ex. 
+ * memleak-top, read them without disturbing this one. Sites created before
+ * the segment was opened, or after it filled up, are not in it.
+ * A forked child copies the segment to one of its own on its first 
+ * allocation or free, so that they are not counted in the parent's 
+ * segment. Children that exec or exit before that create none.
+ * Segments of processes that are gone are removed when a segment is opened.
+ * 
+*****************************************************************************/
+
+#ifndef SS_MEMTRACE_SHM_SITES
+# define SS_MEMTRACE_SHM_SITES  4096
+#endif
+
+#define SHM_HEADER_SIZE  4096
+#define SHM_SITE_SIZE    (sizeof(struct mlshm_site) + SS_MEMTRACE_SHARDS * sizeof(struct alloc_counters))
+#define SHM_SIZE         (SHM_HEADER_SIZE + SS_MEMTRACE_SHM_SITES * SHM_SITE_SIZE)
+
+#define shm_site(n)  ((struct mlshm_site *) ((char *) shm_header + SHM_HEADER_SIZE + (n) * SHM_SITE_SIZE))
+
+static struct mlshm_header *shm_header;
+static unsigned int        shm_reserved;  // Sites taken, under rec_lock
+
+
+// Counters of the next free site of the segment, or NULL. Called under rec_lock.
+static struct alloc_counters *
+shm_site_reserve(void)
+{
+	struct mlshm_header *const header = __atomic_load_n(&shm_header, __ATOMIC_ACQUIRE);
+	
+	if (!header) {
+		return NULL;
+	}
+	
+	if (__builtin_expect(shm_child_pending, 0)) {
+		shm_child();
+	}
+	
+	if (shm_reserved >= SS_MEMTRACE_SHM_SITES) {
+		__atomic_fetch_add(&header->dropped_sites, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	
+	return (struct alloc_counters *) (shm_site(shm_reserved++) + 1);
+}
+
+
+// Names the site reserved last and shows it to readers. Called under rec_lock.
+static void
+shm_site_publish(struct alloc_record const *const record)
+{
+	struct mlshm_site *const site = shm_site(shm_reserved - 1);
+	char name[SITE_NAME_MAX];
+	
+	strncpy(site->name, site_name(record, name, sizeof(name)), sizeof(site->name) - 1);
+	site->id = record->id;
+	
+	__atomic_store_n(&shm_header->nr_sites, shm_reserved, __ATOMIC_RELEASE);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Creates the shared memory segment of the calling process, named by its
+	process id.
+  
+  Wants:
+    Nothing.
+	
+  Gives: 
+    File descriptor of the segment, or -1 on failure.
+----------------------------------------------------------------------------*/
+
+static int
+shm_create(void)
+{
+	char name[32];
+	
+	snprintf(name, sizeof(name), MLSHM_NAME_FMT, (int) getpid());
+	
+	int const fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	
+	if (fd < 0) {
+		ml_log(SS_TRACE ": Creating shared memory %s failed: %s\n", name, strerror(errno));
+		return -1;
+	}
+	
+	if (ftruncate(fd, SHM_SIZE)) {
+		ml_log(SS_TRACE ": Sizing shared memory %s failed: %s\n", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	
+	return fd;
+}
+
+
+static void
+shm_unlink_at_exit(void)
+{
+	char name[32];
+	
+	snprintf(name, sizeof(name), MLSHM_NAME_FMT, (int) getpid());
+	shm_unlink(name);
+}
+
+
+// Marks a forked child to move its counters on their first use. The move
+// is not done here, the child may exec or exit right away.
+static void
+shm_fork_child(void)
+{
+	__atomic_store_n(&shm_child_pending, true, __ATOMIC_RELAXED);
+}
+
+
+// Moves the counters of a forked child to a segment of its own
+static void
+shm_child(void)
+{
+	if (!__atomic_exchange_n(&shm_child_pending, false, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	
+	size_t const used = SHM_HEADER_SIZE + shm_reserved * SHM_SITE_SIZE;
+	int const fd = shm_create();
+	
+	if (fd < 0) {
+		ml_log(SS_TRACE ": Child %d counts in the shared memory of its parent\n", (int) getpid());
+		return;
+	}
+	
+	fd_write(fd, (char const *) shm_header, used);
+	
+	if (MAP_FAILED == mmap(shm_header, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)) {
+		ml_log(SS_TRACE ": Child %d counts in the shared memory of its parent\n", (int) getpid());
+		shm_unlink_at_exit();
+	}
+	else {
+		shm_header->pid        = getpid();
+		shm_header->start_time = time(NULL);
+	}
+	
+	close(fd);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Opens the shared memory segment where the counters of the sites created 
+	from now on are kept. The segment is removed when the process exits;
+	segments left behind by processes that are gone are removed first.
+  
+  Wants:
+    Nothing.
+	
+  Gives: 
+    0 on success, -1 on failure or if the segment is open already.
+----------------------------------------------------------------------------*/
+
+// Removes the segments of processes that have exited without removing them
+static void
+shm_remove_stale(void)
+{
+	DIR *const dir = opendir("/dev/shm");
+	struct dirent *entry;
+	
+	if (!dir) {
+		return;
+	}
+	
+	while ((entry = readdir(dir))) {
+		char name[32];
+		int pid;
+		
+		if (1 != sscanf(entry->d_name, MLSHM_NAME_FMT + 1, &pid)  ||  pid <= 0) {
+			continue;
+		}
+		
+		snprintf(name, sizeof(name), MLSHM_NAME_FMT, pid);
+		
+		// Only the exact name, and only if nobody has the pid
+		if (0 == strcmp(name + 1, entry->d_name)  &&  kill(pid, 0)  &&  ESRCH == errno) {
+			shm_unlink(name);
+		}
+	}
+	
+	closedir(dir);
+}
+
+
+int
+memleak_shm_open(void)
+{
+	static bool opened;
+	struct mlshm_header *header;
+	
+	if (__atomic_test_and_set(&opened, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	
+	shm_remove_stale();
+	
+	int const fd = shm_create();
+	
+	if (fd < 0) {
+		return -1;
+	}
+	
+	void *const mem = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	
+	close(fd);
+	
+	if (MAP_FAILED == mem) {
+		ml_log(SS_TRACE ": Mapping shared memory failed: %s\n", strerror(errno));
+		shm_unlink_at_exit();
+		return -1;
+	}
+	
+	header = (struct mlshm_header *) mem;
+	memcpy(header->magic, MLSHM_MAGIC, sizeof(header->magic));
+	header->version        = MLSHM_VERSION;
+	header->header_size    = SHM_HEADER_SIZE;
+	header->site_size      = SHM_SITE_SIZE;
+	header->max_sites      = SS_MEMTRACE_SHM_SITES;
+	header->shards         = SS_MEMTRACE_SHARDS;
+	header->shard_size     = sizeof(struct alloc_counters);
+	header->counter_size   = sizeof(long);
+	header->est_one        = EST_ONE;
+	header->off_blocks     = offsetof(struct alloc_counters, cnt);
+	header->off_bytes      = offsetof(struct alloc_counters, mem_total);
+	header->off_est_blocks = offsetof(struct alloc_counters, est_cnt);
+	header->off_est_bytes  = offsetof(struct alloc_counters, est_bytes);
+	header->off_allocs     = offsetof(struct alloc_counters, allocs);
+	header->pid            = getpid();
+	header->start_time     = time(NULL);
+	
+	atexit(shm_unlink_at_exit);
+	pthread_atfork(NULL, NULL, shm_fork_child);
+	
+	__atomic_store_n(&shm_header, header, __ATOMIC_RELEASE);
+	
+	return 0;
+}
+
+
+#ifdef SS_MEMTRACE_SHM
+class SharedStatsOpener
+{
+public:
+	SharedStatsOpener() { memleak_shm_open(); }
+};
+
+static SharedStatsOpener SharedOpener;
+#endif
+
+
+/****************************************************************************
+   REPORTING OPERATIONS
+*****************************************************************************/
+
+/***** Snapshots ************************************************************
+ *
+ * Reports work on a snapshot: the counters of every site are summed up in 
+ * an array without locking, since records are never removed and their 
+ * counters are atomic. Sorting, formatting and writing happen on the copy,
+ * so allocating threads never wait for a report. Only reports wait for 
+ * each other, on report_lock.
+ * 
+*****************************************************************************/
+
+struct site_snapshot
+{
+	struct alloc_record   *record;
+	struct alloc_counters sum;
+};
+
+
+static int
+snapshot_compare(void const *const a, void const *const b)
+{
+	return record_compare(&((struct site_snapshot const *) a)->record, &((struct site_snapshot const *) b)->record);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Sums up the counters of all sites in an array sorted by file and line.
+	Sites created meanwhile may be left out. Raises the peaks of the sites.
+  
+  Wants:
+    count - Where to store the number of sites.
+	
+  Gives: 
+    Array to be freed by the caller, or NULL if there are no sites or 
+	memory ran out.
+----------------------------------------------------------------------------*/
+
+static struct site_snapshot *
+snapshot_take(unsigned int *const count)
+{
+	// Ids are given in creation order, so the newest record tells how many 
+	// records are reachable from it
+	struct alloc_record *list_it = record_load(all_records);
+	unsigned int const max = list_it ? list_it->id : 0;
+	struct site_snapshot *snap;
+	unsigned int i = 0;
+	void *mem;
+	
+	*count = 0;
+	
+	if (0 == max) {
+		return NULL;
+	}
+	
+	if (real_posix_memalign(&mem, CACHE_LINE_SIZE, max * sizeof(*snap))) {
+		ml_log(SS_TRACE ": Failed to allocate memory for report\n");
+		return NULL;
+	}
+	
+	snap = (struct site_snapshot *) mem;
+	
+	for (; list_it  &&  i < max; list_it = list_it->all_next, ++i) {
+		long cnt;
+		size_t bytes;
+		
+		snap[i].record = list_it;
+		record_sum(list_it, &snap[i].sum);
+		
+		record_estimate(&snap[i].sum, &cnt, &bytes);
+		atomic_max(&list_it->peak_blocks, cnt);
+		atomic_max(&list_it->peak_bytes, (long) bytes);
+	}
+	
+	// qsort may allocate, which must not be tracked
+	ml_busy(true);
+	qsort(snap, i, sizeof(*snap), snapshot_compare);
+	ml_busy(false);
+	*count = i;
+	
+	return snap;
+}
+
+
+// Leaves the sites of one epoch in a snapshot. Gives their number.
+static unsigned int
+snapshot_filter(struct site_snapshot *const snap, unsigned int const count, struct alloc_epoch const *const epoch)
+{
+	unsigned int kept = 0;
+	unsigned int i;
+	
+	for (i = 0; i < count; ++i) {
+		if (snap[i].record->epoch == epoch) {
+			snap[kept++] = snap[i];
+		}
+	}
+	
+	return kept;
+}
+
+
+#ifdef SS_ENABLE_MEMTRACE_EXIT
+
+class RecordExitChecker
+{
+public:
+	RecordExitChecker() { }
+	~RecordExitChecker()
+	{
+		struct site_snapshot *snap;
+		unsigned int count;
+		unsigned int i;
+		
+		ml_log(SS_TRACE ": Application exited\n");
+		ss_pthread_mutex_lock(&report_lock);
+		
+		snap = snapshot_take(&count);
+		
+		for (i = 0; i < count; ++i)
+		{
+			struct alloc_record const *const list_it = snap[i].record;
+			char name[SITE_NAME_MAX];
+			
+			long cnt;
+			size_t bytes;
+			
+			record_estimate(&snap[i].sum, &cnt, &bytes);
+			ml_log(SS_TRACE ": %ld unclean records from %s  %s\n", cnt, site_name(list_it, name, sizeof(name)),
+				list_it->overallocations ? "(OA)" : "");
+			
+			if (list_it->stack) {
+				stack_report(list_it->stack);
+			}
+		}
+		
+		ss_pthread_mutex_unlock(&report_lock);
+		real_free(snap);
+		
+		memleak_log_flush();
+	}
+};
+
+
+static RecordExitChecker ExitChecker;
+
+#endif  // SS_ENABLE_MEMTRACE_EXIT
+
+
+// Monotonic time in seconds
+static double
+ml_seconds(void)
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+// Allocation rates of the first report are counted from here
+static double const start_time = ml_seconds();
+
+
+// Formats a byte count shortly, f.ex. 512, 4K, 2M
+static char const *
+bytes_label(unsigned long const bytes, char *const buf, size_t const size)
+{
+	if (bytes >= (1UL << 20)  &&  0 == bytes % (1UL << 20)) {
+		snprintf(buf, size, "%luM", bytes >> 20);
+	}
+	else if (bytes >= (1UL << 10)  &&  0 == bytes % (1UL << 10)) {
+		snprintf(buf, size, "%luK", bytes >> 10);
+	}
+	else {
+		snprintf(buf, size, "%lu", bytes);
+	}
+	
+	return buf;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Prints the allocation rate of a site since its previous report and how 
+	many of its allocations fell in every log2 size class. A class is shown
+	by its smallest size: "16: 120" are 120 blocks of 16..31 bytes. 
+	When sampling, only the sampled allocations are counted.
+  
+  Wants:
+    record - The site.
+	sum    - The site's summed counters.
+	now    - Time of the report, from ml_seconds().
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+size_class_report(struct alloc_record *const record, struct alloc_counters const *const sum, double const now)
+{
+	double const since = record->rate_since > 0.0 ? record->rate_since : start_time;
+	double const rate  = now > since ? (sum->allocs - record->rate_allocs) / (now - since) : 0.0;
+	char line[512];
+	size_t len;
+	int k;
+	
+	len = snprintf(line, sizeof(line), SS_TRACE ":        %ld allocs, %.1f/s, sizes", sum->allocs, rate);
+	
+	for (k = 0; k < SS_MEMTRACE_SIZE_CLASSES  &&  len < sizeof(line); ++k) {
+		char label[16];
+		
+		if (0 == sum->size_class[k]) {
+			continue;
+		}
+		
+		len += snprintf(line + len, sizeof(line) - len, " %s%s: %ld", 
+			bytes_label(k ? 1UL << (k - 1) : 0, label, sizeof(label)), 
+			k == SS_MEMTRACE_SIZE_CLASSES - 1 ? "+" : "", sum->size_class[k]);
+	}
+	
+	ml_log("%s\n", line);
+	
+	record->rate_allocs = sum->allocs;
+	record->rate_since  = now;
+}
+
+
+unsigned long ss_memleak_short_lived_us = SS_MEMTRACE_SHORT_LIVED_US_DEFAULT;
+
+
+// Timestamp ticks per second, measured on first use
+static double
+lifetime_ticks_per_sec(void)
+{
+	static double ticks_per_sec;
+	
+	if (0.0 == ticks_per_sec) {
+		ticks_per_sec = (double) event_ticks_per_sec();
+	}
+	
+	return ticks_per_sec;
+}
+
+
+// Formats a duration shortly, f.ex. 850ns, 12us, 3ms, 2s
+static char const *
+time_label(double const sec, char *const buf, size_t const size)
+{
+	if (sec < 1e-6) {
+		snprintf(buf, size, "%.0fns", sec * 1e9);
+	}
+	else if (sec < 1e-3) {
+		snprintf(buf, size, "%.0fus", sec * 1e6);
+	}
+	else if (sec < 1.0) {
+		snprintf(buf, size, "%.0fms", sec * 1e3);
+	}
+	else {
+		snprintf(buf, size, "%.0fs", sec);
+	}
+	
+	return buf;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Prints how long the freed blocks of a site lived. A class is shown by 
+	its upper limit: "<4us: 300" are 300 blocks freed within 1..4 us.
+  
+  Wants:
+    sum - The site's summed counters.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+lifetime_report(struct alloc_counters const *const sum)
+{
+	double const ticks_per_sec = lifetime_ticks_per_sec();
+	char line[512];
+	size_t len;
+	int k;
+	
+	len = snprintf(line, sizeof(line), SS_TRACE ":        lifetimes");
+	
+	for (k = 0; k < LIFETIME_CLASSES  &&  len < sizeof(line); ++k) {
+		char label[16];
+		
+		if (0 == sum->lifetime[k]) {
+			continue;
+		}
+		
+		if (k < LIFETIME_CLASSES - 1) {
+			time_label(lifetime_class_limit(k) / ticks_per_sec, label, sizeof(label));
+			len += snprintf(line + len, sizeof(line) - len, " <%s: %ld", label, sum->lifetime[k]);
+		}
+		else {
+			time_label(lifetime_class_limit(k - 1) / ticks_per_sec, label, sizeof(label));
+			len += snprintf(line + len, sizeof(line) - len, " >=%s: %ld", label, sum->lifetime[k]);
+		}
+	}
+	
+	ml_log("%s\n", line);
+}
+
+
+struct short_lived
+{
+	struct alloc_record const *record;
+	long                      blocks;  // Freed within the limit
+	long                      frees;
+};
+
+
+static int
+short_lived_compare(void const *const a, void const *const b)
+{
+	struct short_lived const *const sl_a = (struct short_lived const *) a;
+	struct short_lived const *const sl_b = (struct short_lived const *) b;
+	
+	return sl_a->blocks > sl_b->blocks ? -1 : sl_a->blocks < sl_b->blocks;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Ranks the sites by the number of blocks freed within 
+	ss_memleak_short_lived_us, ie. blocks that could live on the stack or 
+	in an arena instead. The limit is rounded down to a lifetime class.
+  
+  Wants:
+    snap  - Snapshot of all sites.
+	count - Number of sites.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+short_lived_report(struct site_snapshot const *const snap, unsigned int const count)
+{
+	double const limit = ss_memleak_short_lived_us * 1e-6 * lifetime_ticks_per_sec();
+	struct short_lived *const ranked = (struct short_lived *) real_malloc(count * sizeof(*ranked) + 1);
+	unsigned int nr_ranked = 0;
+	unsigned int i;
+	int classes = 0;
+	char label[16];
+	
+	if (!ranked) {
+		return;
+	}
+	
+	while (classes < LIFETIME_CLASSES - 1  &&  lifetime_class_limit(classes) <= limit) {
+		++classes;
+	}
+	
+	for (i = 0; i < count; ++i) {
+		long blocks = 0;
+		long frees  = 0;
+		int k;
+		
+		for (k = 0; k < LIFETIME_CLASSES; ++k) {
+			blocks += k < classes ? snap[i].sum.lifetime[k] : 0;
+			frees  += snap[i].sum.lifetime[k];
+		}
+		
+		if (blocks > 0) {
+			ranked[nr_ranked].record = snap[i].record;
+			ranked[nr_ranked].blocks = blocks;
+			ranked[nr_ranked].frees  = frees;
+			++nr_ranked;
+		}
+	}
+	
+	ml_busy(true);
+	qsort(ranked, nr_ranked, sizeof(*ranked), short_lived_compare);
+	ml_busy(false);
+	
+	time_label(classes ? lifetime_class_limit(classes - 1) / lifetime_ticks_per_sec() : 0.0, label, sizeof(label));
+	ml_log(SS_TRACE ": Short-lived blocks, freed within %s\n", label);
+	
+	for (i = 0; i < nr_ranked; ++i) {
+		char name[SITE_NAME_MAX];
+		
+		ml_log(SS_TRACE ": %8ld of %8ld frees from %s\n", ranked[i].blocks, ranked[i].frees, 
+			site_name(ranked[i].record, name, sizeof(name)));
+	}
+	
+	real_free(ranked);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Prints the frees of the blocks of every allocating thread (rows) by 
+	every freeing thread (columns). Threads are numbered as in the event
+	stream; the last row and column hold all later threads. Threads that 
+	have freed nothing of others' and whose blocks nobody else freed are 
+	left out.
+  
+  Wants:
+    Nothing.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+thread_matrix_report(void)
+{
+	static long matrix[SS_MEMTRACE_THREAD_MATRIX][SS_MEMTRACE_THREAD_MATRIX];  // Under report_lock
+	bool shown[SS_MEMTRACE_THREAD_MATRIX];
+	unsigned int const threads = __atomic_load_n(&next_thread_id, __ATOMIC_RELAXED);
+	unsigned int const slots = threads < SS_MEMTRACE_THREAD_MATRIX ? threads : SS_MEMTRACE_THREAD_MATRIX;
+	char line[32 + 12 * SS_MEMTRACE_THREAD_MATRIX];
+	unsigned int producer, consumer;
+	size_t len;
+	
+	for (producer = 0; producer < slots; ++producer) {
+		shown[producer] = false;
+	}
+	
+	for (producer = 0; producer < slots; ++producer) {
+		for (consumer = 0; consumer < slots; ++consumer) {
+			long frees = 0;
+			unsigned int shard;
+			
+			if (consumer < SS_MEMTRACE_THREAD_MATRIX - 1) {
+				frees = __atomic_load_n(&thread_frees[consumer].producer[producer], __ATOMIC_RELAXED);
+			}
+			else {
+				for (shard = 0; shard < SS_MEMTRACE_SHARDS; ++shard) {
+					frees += __atomic_load_n(&thread_frees_later[shard].producer[producer], __ATOMIC_RELAXED);
+				}
+			}
+			
+			matrix[producer][consumer] = frees;
+			
+			if (frees  &&  (producer != consumer  ||  SS_MEMTRACE_THREAD_MATRIX - 1 == producer)) {
+				shown[producer] = shown[consumer] = true;
+			}
+		}
+	}
+	
+	ml_log(SS_TRACE ": Frees by allocating (rows) and freeing (columns) thread\n");
+	len = snprintf(line, sizeof(line), SS_TRACE ":       ");
+	
+	for (consumer = 0; consumer < slots; ++consumer) {
+		if (shown[consumer]) {
+			len += snprintf(line + len, sizeof(line) - len, " %10u%s", consumer + 1, 
+				SS_MEMTRACE_THREAD_MATRIX - 1 == consumer ? "+" : " ");
+		}
+	}
+	
+	ml_log("%s\n", line);
+	
+	for (producer = 0; producer < slots; ++producer) {
+		if (!shown[producer]) {
+			continue;
+		}
+		
+		len = snprintf(line, sizeof(line), SS_TRACE ": %4u%s ", producer + 1, 
+			SS_MEMTRACE_THREAD_MATRIX - 1 == producer ? "+" : " ");
+		
+		for (consumer = 0; consumer < slots; ++consumer) {
+			if (shown[consumer]) {
+				len += snprintf(line + len, sizeof(line) - len, " %10ld ", matrix[producer][consumer]);
+			}
+		}
+		
+		ml_log("%s\n", line);
+	}
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Prints out the current status of alloated memory blocks.
+  
+  Wants:
+    flags
+	  MEML_TIGHT - All counters in one line.
+	  MEML_SUPPRESS_ZEROS - Do not display zero counters.
+	  MEML_ONLY_CHANGED - Print only changed records.
+	  MEML_SIZE_CLASSES - Print allocation rates and size classes too.
+	  MEML_LIFETIMES - Print lifetimes of freed blocks too, and rank sites
+	                   by short-lived blocks.
+	  MEML_THREADS - Print cross-thread frees of the sites, and the frees
+	                 by allocating and freeing thread.
+	title - Heading of the report.
+	all   - Report the sites of all epochs.
+	epoch - Otherwise the epoch to report, NULL for allocations made in no
+	        epoch.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+sites_report(int const flags, char const *const title, bool const all, struct alloc_epoch const *const epoch)
+{
+	const bool tight     = flags & MEML_TIGHT;
+	const bool suppress0 = flags & MEML_SUPPRESS_ZEROS;
+	const bool changed   = flags & MEML_ONLY_CHANGED;
+	const bool classes   = flags & MEML_SIZE_CLASSES;
+	const bool lifetimes = flags & MEML_LIFETIMES;
+	const bool threads   = flags & MEML_THREADS;
+	const bool sampling  = __atomic_load_n(&ss_memleak_sample_period, __ATOMIC_RELAXED) > 0;
+	const double now     = classes ? ml_seconds() : 0.0;
+	struct site_snapshot *snap;
+	unsigned int count;
+	unsigned int i;
+	
+	
+	if (!tight)  ml_log(SS_TRACE ": %s\n", title);
+	if (tight)   ml_log(SS_TRACE ": ");
+	
+	ss_pthread_mutex_lock(&report_lock);
+	
+	snap = snapshot_take(&count);
+	
+	if (!all) {
+		count = snapshot_filter(snap, count, epoch);
+	}
+	
+	for (i = 0; i < count; ++i)
+	{
+		struct alloc_record *const list_it = snap[i].record;
+		struct alloc_counters const &sum = snap[i].sum;
+		char name[SITE_NAME_MAX];
+		
+		if (changed  &&  !__atomic_load_n(&list_it->dirty, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		
+		long cnt;
+		size_t bytes;
+		
+		record_estimate(&sum, &cnt, &bytes);
+		
+		if (suppress0  &&  0 == sum.cnt) {
+			continue;
+		}
+		
+		__atomic_store_n(&list_it->dirty, false, __ATOMIC_RELAXED);
+		
+		if (tight) {
+			ml_log("%ld ", cnt);
+		}
+		else if (sampling) {
+			ml_log(SS_TRACE ": %4ld records, %7lu bytes from line %s  %s (%ld sampled)\n", cnt, bytes, site_name(list_it, name, sizeof(name)),
+				list_it->overallocations ? "(OA)" : "", sum.cnt);
+		}
+		else {
+			ml_log(SS_TRACE ": %4ld records, %7lu bytes from line %s  %s\n", cnt, bytes, site_name(list_it, name, sizeof(name)),
+				list_it->overallocations ? "(OA)" : "");
+		}
+		
+		long const overruns = __atomic_load_n(&list_it->overruns, __ATOMIC_RELAXED);
+		
+		if (!tight  &&  overruns) {
+			ml_log(SS_TRACE ":      %ld overruns found by guards\n", overruns);
+		}
+		
+		if (!tight  &&  list_it->stack) {
+			stack_report(list_it->stack);
+		}
+		
+		if (!tight  &&  classes) {
+			size_class_report(list_it, &sum, now);
+		}
+		
+		if (!tight  &&  lifetimes) {
+			lifetime_report(&sum);
+		}
+		
+		if (!tight  &&  threads  &&  sum.frees) {
+			ml_log(SS_TRACE ":        frees %ld, by other threads %ld (%.0f%%)\n", sum.frees, sum.cross_frees, 
+				100.0 * sum.cross_frees / sum.frees);
+		}
+	}
+	
+	if (!tight  &&  lifetimes) {
+		short_lived_report(snap, count);
+	}
+	
+	if (!tight  &&  threads) {
+		thread_matrix_report();
+	}
+	
+	ss_pthread_mutex_unlock(&report_lock);
+	real_free(snap);
+	
+	if (tight) ml_log("\n");
+}
+
+
+void
+memleak_report(int const flags)
+{
+	sites_report(flags, __FUNCTION__, true, NULL);
+}
+
+
+// Reports only the sites of an epoch
+void
+memleak_epoch_report(struct alloc_epoch const *const epoch, int const flags)
+{
+	char title[SITE_NAME_MAX];
+	
+	snprintf(title, sizeof(title), "%s [%s]", __FUNCTION__, epoch ? epoch->name : "no epoch");
+	sites_report(flags, title, false, epoch);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Calls a function for every allocation site, sorted by file and line. 
+	The counters come from a snapshot, allocating threads are not blocked.
+	The function may allocate and even call memleak_report().
+  
+  Wants:
+    fn  - The function to call.
+	arg - Passed to fn as such.
+	
+  Gives: 
+    The number of sites, -1 if memory ran out.
+----------------------------------------------------------------------------*/
+
+// Fills in the public view of a site in a snapshot
+static void
+site_fill(struct site_snapshot const *const snap, struct memleak_site *const site)
+{
+	struct alloc_record const *const record = snap->record;
+	
+	site->file            = record->file;
+	site->line            = record->line;
+	site->caller          = record->caller;
+	site->epoch           = record->epoch ? record->epoch->name : NULL;
+	site->sampled_blocks  = snap->sum.cnt;
+	site->allocs          = snap->sum.allocs;
+	site->frees           = snap->sum.frees;
+	site->cross_frees     = snap->sum.cross_frees;
+	site->peak_blocks     = __atomic_load_n(&record->peak_blocks, __ATOMIC_RELAXED);
+	site->peak_bytes      = (size_t) __atomic_load_n(&record->peak_bytes, __ATOMIC_RELAXED);
+	site->overallocations = __atomic_load_n(&record->overallocations, __ATOMIC_RELAXED);
+	site->overruns        = __atomic_load_n(&record->overruns, __ATOMIC_RELAXED);
+	site->record          = record;
+	record_estimate(&snap->sum, &site->blocks, &site->bytes);
+}
+
+
+int
+memleak_sites(memleak_site_fn const fn, void *const arg)
+{
+	struct site_snapshot *snap;
+	unsigned int count;
+	unsigned int i;
+	
+	snap = snapshot_take(&count);
+	
+	if (!snap  &&  record_load(all_records)) {
+		return -1;
+	}
+	
+	for (i = 0; i < count; ++i) {
+		struct memleak_site site;
+		
+		site_fill(&snap[i], &site);
+		fn(&site, arg);
+	}
+	
+	real_free(snap);
+	
+	return (int) count;
+}
+
+
+// Formats the name of a site like the reports do
+char const *
+memleak_site_name(struct memleak_site const *const site, char *const buf, size_t const size)
+{
+	return site_name(site->record, buf, size);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Searches the number of active allocations, made by memleak facility, made 
+	from the same line of code as the given ptr.
+  
+  Wants:
+    ptr
+	  A pointer of a memory allocated by memleak facility.
+	
+  Gives: 
+    > 0
+	  The number of listed active allocations.
+	-1
+	  The ptr was invalid, ie. not listed by memleak facility.
+----------------------------------------------------------------------------*/
+
+int 
+memleak_allocs_at(void const *const ptr)
+{
+	struct piggyback_data const *const pbdata = owned_block(ptr);
+	struct alloc_counters sum;
+	long cnt;
+	size_t bytes;
+	
+	if (!pbdata) {
+		return -1;
+	}
+	
+	record_sum(pbdata->record, &sum);
+	record_estimate(&sum, &cnt, &bytes);
+	
+	return (int) cnt;
+}
+
+
+/****************************************************************************
+   WATERMARKS
+*****************************************************************************/
+
+/***** Watermarks ***********************************************************
+ *
+ * The allocation path only adds to thread local totals of the process heap.
+ * A thread folds them in the global totals, and raises the peaks, when 
+ * they have changed by SS_MEMTRACE_WATERMARK_BATCH bytes or 
+ * HEAP_BATCH_BLOCKS blocks, so the shared cache lines are rarely touched.
+ * The totals lag behind by at most a batch per thread.
+ * 
+ * Limits are checked by a watcher thread started by the first call of 
+ * memleak_watermarks_set(). Every interval it reads the totals and, if 
+ * there are limits per site, takes a snapshot of the sites. An alarm is 
+ * raised when a value goes over its limit, and again only after the value
+ * has been back under it. The alarm function runs in the watcher thread, 
+ * never in an allocating one. Peaks of sites are the highest values seen 
+ * by the watcher and reports.
+ * 
+*****************************************************************************/
+
+// Process totals are folded after this many bytes of change per thread
+#ifndef SS_MEMTRACE_WATERMARK_BATCH
+# define SS_MEMTRACE_WATERMARK_BATCH  65536
+#endif
+
+#ifndef SS_MEMTRACE_WATERMARK_INTERVAL_MS
+# define SS_MEMTRACE_WATERMARK_INTERVAL_MS  100
+#endif
+
+#define HEAP_BATCH_BLOCKS  64
+
+static long heap_bytes;
+static long heap_blocks;
+static long heap_peak_bytes;
+static long heap_peak_blocks;
+
+static ml_thread long heap_pending_bytes;
+static ml_thread long heap_pending_blocks;
+static ml_thread bool heap_pending_kept;  // Folded at thread exit
+
+static pthread_key_t  heap_key;
+static pthread_once_t heap_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  watch_once = PTHREAD_ONCE_INIT;
+static struct memleak_watermarks watch_marks;
+static bool watch_started;
+
+
+static void heap_thread_exit(void *);
+
+
+static void
+heap_key_create(void)
+{
+	pthread_key_create(&heap_key, heap_thread_exit);
+}
+
+
+// Moves the calling thread's totals to the process totals
+static void
+heap_fold(void)
+{
+	long const bytes  = __atomic_add_fetch(&heap_bytes, heap_pending_bytes, __ATOMIC_RELAXED);
+	long const blocks = __atomic_add_fetch(&heap_blocks, heap_pending_blocks, __ATOMIC_RELAXED);
+	
+	heap_pending_bytes  = 0;
+	heap_pending_blocks = 0;
+	
+	atomic_max(&heap_peak_bytes, bytes);
+	atomic_max(&heap_peak_blocks, blocks);
+	
+	if (__builtin_expect(!heap_pending_kept, 0)) {
+		// The C library may allocate for the key
+		heap_pending_kept = true;
+		ml_busy(true);
+		pthread_once(&heap_key_once, heap_key_create);
+		pthread_setspecific(heap_key, &heap_pending_kept);
+		ml_busy(false);
+	}
+}
+
+
+static void
+heap_thread_exit(void *)
+{
+	heap_fold();
+}
+
+
+// Counts a block in the process totals. 'weight' is the number of blocks
+// it stands for when sampling.
+static inline void
+heap_count(int const sign, size_t const size, double const weight)
+{
+	if (__builtin_expect(1.0 == weight, 1)) {
+		heap_pending_blocks += sign;
+		heap_pending_bytes  += sign * (long) size;
+	}
+	else {
+		heap_pending_blocks += sign * (long) (weight + 0.5);
+		heap_pending_bytes  += sign * (long) (weight * size + 0.5);
+	}
+	
+	if (__builtin_expect((unsigned long) (heap_pending_bytes + SS_MEMTRACE_WATERMARK_BATCH) > 2 * SS_MEMTRACE_WATERMARK_BATCH  ||
+		(unsigned long) (heap_pending_blocks + HEAP_BATCH_BLOCKS) > 2 * HEAP_BATCH_BLOCKS, 0)) {
+		heap_fold();
+	}
+}
+
+
+void
+memleak_heap_usage(struct memleak_heap *const heap)
+{
+	if (heap_pending_bytes  ||  heap_pending_blocks) {
+		heap_fold();
+	}
+	
+	heap->bytes       = __atomic_load_n(&heap_bytes, __ATOMIC_RELAXED);
+	heap->blocks      = __atomic_load_n(&heap_blocks, __ATOMIC_RELAXED);
+	heap->peak_bytes  = __atomic_load_n(&heap_peak_bytes, __ATOMIC_RELAXED);
+	heap->peak_blocks = __atomic_load_n(&heap_peak_blocks, __ATOMIC_RELAXED);
+}
+
+
+// Logs an alarm and writes a report of the sites in use
+static void
+watch_alarm_report(struct memleak_alarm const *const alarm, void *)
+{
+	static char const *const what[] = { "", "bytes", "blocks", "bytes/s" };
+	char name[SITE_NAME_MAX];
+	
+	ml_log(SS_TRACE ": Watermark exceeded: %ld %s > %ld at %s\n", alarm->value, what[alarm->type], alarm->limit,
+		alarm->site ? memleak_site_name(alarm->site, name, sizeof(name)) : "process heap");
+	
+	memleak_report(MEML_SUPPRESS_ZEROS);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Compares a value to its limit and raises an alarm when the value has
+	gone over it since the previous check.
+  
+  Wants:
+    marks  - The limits in effect.
+	alarms - Bits of the alarms raised of the heap or site.
+	type   - MEML_ALARM_*
+	value  - Current value.
+	limit  - The limit, 0 if not checked.
+	site   - The site, NULL for the process heap.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+watch_check(struct memleak_watermarks const *const marks, unsigned int *const alarms, int const type, 
+	long const value, long const limit, struct memleak_site const *const site)
+{
+	unsigned int const bit = 1U << type;
+	struct memleak_alarm alarm;
+	
+	if (0 == limit  ||  value <= limit) {
+		*alarms &= ~bit;
+		return;
+	}
+	
+	if (*alarms & bit) {
+		return;
+	}
+	
+	*alarms |= bit;
+	
+	alarm.type  = type;
+	alarm.value = value;
+	alarm.limit = limit;
+	alarm.site  = site;
+	
+	(marks->fn ? marks->fn : watch_alarm_report)(&alarm, marks->arg);
+}
+
+
+// Checks the limits of every site
+static void
+watch_sites(struct memleak_watermarks const *const marks, double const elapsed, bool const first)
+{
+	struct site_snapshot *snap;
+	unsigned int count;
+	unsigned int i;
+	
+	snap = snapshot_take(&count);
+	
+	for (i = 0; i < count; ++i) {
+		struct alloc_record *const record = snap[i].record;
+		struct memleak_site site;
+		
+		site_fill(&snap[i], &site);
+		
+		long const growth = first ? 0 : (long) (((long) site.bytes - record->watch_bytes) / elapsed);
+		
+		record->watch_bytes = (long) site.bytes;
+		
+		watch_check(marks, &record->alarms, MEML_ALARM_BYTES, (long) site.bytes, (long) marks->site_bytes, &site);
+		watch_check(marks, &record->alarms, MEML_ALARM_BLOCKS, site.blocks, marks->site_blocks, &site);
+		watch_check(marks, &record->alarms, MEML_ALARM_GROWTH, growth, (long) marks->site_growth, &site);
+	}
+	
+	real_free(snap);
+}
+
+
+static void *
+watch_thread(void *)
+{
+	unsigned int heap_alarms = 0;
+	long   last_bytes = 0;
+	double last = 0.0;
+	bool   sites_first = true;
+	sigset_t all;
+	
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	
+	for (;;) {
+		struct memleak_watermarks marks;
+		struct memleak_heap heap;
+		
+		pthread_mutex_lock(&watch_lock);
+		marks = watch_marks;
+		pthread_mutex_unlock(&watch_lock);
+		
+		unsigned int const interval = marks.interval_ms ? marks.interval_ms : SS_MEMTRACE_WATERMARK_INTERVAL_MS;
+		struct timespec const period = { interval / 1000, (long) (interval % 1000) * 1000000 };
+		
+		nanosleep(&period, NULL);
+		
+		double const now     = ml_seconds();
+		double const elapsed = last > 0.0 ? now - last : 0.0;
+		
+		memleak_heap_usage(&heap);
+		
+		long const growth = elapsed > 0.0 ? (long) ((heap.bytes - last_bytes) / elapsed) : 0;
+		
+		watch_check(&marks, &heap_alarms, MEML_ALARM_BYTES, heap.bytes, (long) marks.heap_bytes, NULL);
+		watch_check(&marks, &heap_alarms, MEML_ALARM_BLOCKS, heap.blocks, marks.heap_blocks, NULL);
+		watch_check(&marks, &heap_alarms, MEML_ALARM_GROWTH, growth, (long) marks.heap_growth, NULL);
+		
+		// Growth of a site is measured from the poll its limits were first seen
+		if (marks.site_bytes  ||  marks.site_blocks  ||  marks.site_growth) {
+			watch_sites(&marks, elapsed, sites_first  ||  0.0 == elapsed);
+			sites_first = false;
+		}
+		else {
+			sites_first = true;
+		}
+		
+		last       = now;
+		last_bytes = heap.bytes;
+	}
+	
+	return NULL;
+}
+
+
+static void
+watch_start(void)
+{
+	pthread_t watcher;
+	pthread_attr_t attr;
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	
+	if (pthread_create(&watcher, &attr, watch_thread, NULL)) {
+		fprintf(stderr, SS_TRACE ": Failed to start watermark watcher\n");
+	}
+	else {
+		watch_started = true;
+	}
+	
+	pthread_attr_destroy(&attr);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Sets the watermarks checked by the watcher thread, and starts the 
+	thread on the first call.
+  
+  Wants:
+    marks - The limits. A zero limit is not checked. NULL clears all.
+	
+  Gives: 
+    0 on success, -1 if the watcher could not be started.
+----------------------------------------------------------------------------*/
+
+int
+memleak_watermarks_set(struct memleak_watermarks const *const marks)
+{
+	pthread_mutex_lock(&watch_lock);
+	
+	if (marks) {
+		watch_marks = *marks;
+	}
+	else {
+		memset(&watch_marks, 0, sizeof(watch_marks));
+	}
+	
+	pthread_mutex_unlock(&watch_lock);
+	
+	pthread_once(&watch_once, watch_start);
+	
+	return watch_started ? 0 : -1;
+}
+
+
+/****************************************************************************
+   TRACKING REGIONS
+*****************************************************************************/
+
+/***** Tracking regions *****************************************************
+ *
+ * ss_memleak_tracking turns tracking on in the whole process. A thread can
+ * also track only inside regions, f.ex. while it handles a request, or 
+ * pause tracking for a while. Regions and pauses nest and are counted in 
+ * thread locals, so checking them costs an allocation nothing but the 
+ * relaxed load of the global flag.
+ * 
+ * A region may put its allocations in a named epoch. A site has a record 
+ * of its own in every epoch it allocates in, so the blocks of an epoch are
+ * counted apart from the rest and can be compared to those of another 
+ * epoch. A block stays counted in its epoch wherever it is freed. Epochs 
+ * are never removed.
+ * 
+*****************************************************************************/
+
+static ml_thread int thread_regions;
+static ml_thread int thread_pauses;
+static ml_thread struct alloc_epoch *thread_epoch;
+
+static struct alloc_epoch *epochs;
+static unsigned int       nr_epochs;
+
+// Whether the calling thread's allocations are tracked
+#define tracking_on() \
+	(0 == thread_pauses  &&  (thread_regions > 0  ||  __atomic_load_n(&ss_memleak_tracking, __ATOMIC_RELAXED)))
+
+
+void
+memleak_pause(void)
+{
+	__atomic_store_n(&ss_memleak_tracking, 0, __ATOMIC_RELAXED);
+}
+
+
+void
+memleak_resume(void)
+{
+	__atomic_store_n(&ss_memleak_tracking, 1, __ATOMIC_RELAXED);
+}
+
+
+void
+memleak_thread_pause(void)
+{
+	++thread_pauses;
+}
+
+
+void
+memleak_thread_resume(void)
+{
+	// An unpaired resume must not cancel the next pause
+	if (thread_pauses > 0) {
+		--thread_pauses;
+	}
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Finds the epoch of a name, or creates it. Existing epochs are found 
+	without locking.
+  
+  Wants:
+    name - Name of the epoch. It is copied.
+	
+  Gives: 
+    The epoch, or NULL if memory ran out.
+----------------------------------------------------------------------------*/
+
+struct alloc_epoch *
+memleak_epoch(char const *const name)
+{
+	struct alloc_epoch *epoch;
+	
+	for (epoch = record_load(epochs); epoch; epoch = epoch->next) {
+		if (0 == strcmp(epoch->name, name)) {
+			return epoch;
+		}
+	}
+	
+	ss_pthread_mutex_lock(&rec_lock);
+	
+	for (epoch = epochs; epoch; epoch = epoch->next) {
+		if (0 == strcmp(epoch->name, name)) {
+			break;
+		}
+	}
+	
+	if (!epoch) {
+		size_t const len = strlen(name) + 1;
+		
+		epoch = (struct alloc_epoch *) real_malloc(sizeof(*epoch) + len);
+		
+		if (epoch) {
+			epoch->name = (char const *) memcpy(epoch + 1, name, len);
+			epoch->id   = ++nr_epochs;
+			epoch->next = epochs;
+			record_publish(epochs, epoch);
+		}
+		else {
+			ml_log(SS_TRACE ": Failed to allocate memory for epoch %s\n", name);
+		}
+	}
+	
+	ss_pthread_mutex_unlock(&rec_lock);
+	
+	return epoch;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Starts a tracking region in the calling thread. Its allocations are 
+	tracked until memleak_region_end(), even with ss_memleak_tracking off.
+  
+  Wants:
+    epoch - Epoch to count the allocations in, or NULL to stay in the 
+	        current one.
+	
+  Gives: 
+    The current epoch, to be passed to memleak_region_end().
+----------------------------------------------------------------------------*/
+
+struct alloc_epoch *
+memleak_region_begin(struct alloc_epoch *const epoch)
+{
+	struct alloc_epoch *const prev = thread_epoch;
+	
+	++thread_regions;
+	
+	if (epoch) {
+		thread_epoch = epoch;
+	}
+	
+	return prev;
+}
+
+
+void
+memleak_region_end(struct alloc_epoch *const prev)
+{
+	// An unpaired end must not turn off the regions begun later
+	if (thread_regions > 0) {
+		--thread_regions;
+		thread_epoch = prev;
+	}
+}
+
+
+/****************************************************************************
+   GUARDS
+*****************************************************************************/
+
+/***** Guards ***************************************************************
+ *
+ * Blocks of chosen sites are guarded against overruns:
+ * - MEML_GUARD_CANARY: a canary pattern follows the block and is checked
+ *   when the block is freed or resized. Costs GUARD_CANARY_SIZE bytes and
+ *   a compare per block.
+ * - MEML_GUARD_PAGE: the block gets pages of its own from mmap and ends 
+ *   right in front of an inaccessible page, so an overrun faults at once.
+ *   The few bytes left over for alignment hold a canary. Costs at least
+ *   two pages and three system calls per block.
+ * Sites are chosen by the rules of memleak_guard(). A site takes its mode
+ * when it is created or a rule matching it is added, and a block keeps 
+ * the mode it was allocated with. Overruns are logged and counted per site.
+ * When sampling, only the sampled blocks are guarded.
+ * 
+*****************************************************************************/
+
+#ifndef SS_MEMTRACE_GUARD_RULES
+# define SS_MEMTRACE_GUARD_RULES  16
+#endif
+
+#define GUARD_CANARY_SIZE  16
+#define GUARD_CANARY_BYTE  0xfd
+
+struct guard_rule
+{
+	char const *file;  // End of the file name, NULL for all sites
+	int        line;   // 0 for all lines
+	int        mode;
+};
+
+static struct guard_rule guard_rules[SS_MEMTRACE_GUARD_RULES];
+static unsigned int      nr_guard_rules;  // Under rec_lock
+
+
+static size_t
+guard_page_size(void)
+{
+	static size_t page;
+	
+	if (0 == page) {
+		page = sysconf(_SC_PAGESIZE);
+	}
+	
+	return page;
+}
+
+
+static bool
+guard_rule_match(struct guard_rule const *const rule, char const *const file, int const line)
+{
+	if (!rule->file) {
+		return true;
+	}
+	
+	if (!file  ||  (rule->line  &&  rule->line != line)) {
+		return false;
+	}
+	
+	size_t const file_len = strlen(file);
+	size_t const rule_len = strlen(rule->file);
+	
+	return file_len >= rule_len  &&  0 == strcmp(file + file_len - rule_len, rule->file);
+}
+
+
+// Mode of a new site by the last rule matching it. Called under rec_lock.
+static int
+guard_site_mode(char const *const file, int const line)
+{
+	int mode = MEML_GUARD_NONE;
+	unsigned int i;
+	
+	for (i = 0; i < nr_guard_rules; ++i) {
+		if (guard_rule_match(&guard_rules[i], file, line)) {
+			mode = guard_rules[i].mode;
+		}
+	}
+	
+	return mode;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Guards the blocks allocated from now on at the matching sites. Sites 
+	created later are matched too.
+  
+  Wants:
+    file - The file of the sites or the end of its name, f.ex. "parser.c".
+	       NULL for all sites, also those without a file.
+	line - The line, 0 for all lines of the file.
+	mode - MEML_GUARD_*
+	
+  Gives: 
+    0 on success, -1 if the mode is not known or there are too many rules.
+----------------------------------------------------------------------------*/
+
+int
+memleak_guard(char const *const file, int const line, int const mode)
+{
+	struct alloc_record *list_it;
+	struct guard_rule *rule;
+	char *copy = NULL;
+	
+	if (mode < MEML_GUARD_NONE  ||  mode > MEML_GUARD_PAGE) {
+		return -1;
+	}
+	
+	if (file) {
+		copy = (char *) real_malloc(strlen(file) + 1);
+		
+		if (!copy) {
+			return -1;
+		}
+		
+		strcpy(copy, file);
+	}
+	
+	ss_pthread_mutex_lock(&rec_lock);
+	
+	if (nr_guard_rules == SS_MEMTRACE_GUARD_RULES) {
+		ss_pthread_mutex_unlock(&rec_lock);
+		ml_log(SS_TRACE ": Too many guard rules, increase SS_MEMTRACE_GUARD_RULES\n");
+		real_free(copy);
+		return -1;
+	}
+	
+	rule = &guard_rules[nr_guard_rules++];
+	rule->file = copy;
+	rule->line = line;
+	rule->mode = mode;
+	
+	list_for_each(list_it)
+	{
+		if (guard_rule_match(rule, list_it->file, list_it->line)) {
+			__atomic_store_n(&list_it->guard, mode, __ATOMIC_RELAXED);
+		}
+	}
+	
+	ss_pthread_mutex_unlock(&rec_lock);
+	
+	return 0;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Allocates a block with room for the piggyback in front of the 
+	application's bytes, guarded as asked. The canary is written.
+  
+  Wants:
+    size   - The application's bytes.
+	offset - Room for the piggyback, a multiple of the alignment.
+	align  - Alignment of the application's bytes, 0 for malloc's.
+	guard  - MEML_GUARD_*. Page guards need an alignment of a page at most.
+	block  - Where to store the start of the block.
+	
+  Gives: 
+    The application's pointer, or NULL if memory ran out.
+----------------------------------------------------------------------------*/
+
+static void *
+guard_alloc(size_t const size, size_t const offset, size_t const align, int const guard, void **const block)
+{
+	size_t const extra = MEML_GUARD_CANARY == guard ? GUARD_CANARY_SIZE : 0;
+	
+	if (offset + size + extra < size) {
+		return NULL;
+	}
+	
+	if (MEML_GUARD_PAGE == guard) {
+		size_t const page = guard_page_size();
+		size_t const mask = (align > PIGGYBACK_ALIGN ? align : PIGGYBACK_ALIGN) - 1;
+		size_t const span = (offset + size + mask + page - 1) & ~(page - 1);
+		
+		if (span < offset + size + mask) {
+			return NULL;
+		}
+		
+		char *const mem = (char *) mmap(NULL, span + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		
+		if (MAP_FAILED == mem) {
+			return NULL;
+		}
+		
+		if (mprotect(mem + span, page, PROT_NONE)) {
+			munmap(mem, span + page);
+			return NULL;
+		}
+		
+		// As close to the guard page as the alignment lets
+		char *const ptr = (char *) ((uintptr_t) (mem + span - size) & ~(uintptr_t) mask);
+		
+		memset(ptr + size, GUARD_CANARY_BYTE, mem + span - (ptr + size));
+		*block = mem;
+		
+		return ptr;
+	}
+	
+	char *const mem = (char *) real_alloc(offset + size + extra, align);
+	
+	if (!mem) {
+		return NULL;
+	}
+	
+	memset(mem + offset + size, GUARD_CANARY_BYTE, extra);
+	*block = mem;
+	
+	return mem + offset;
+}
+
+
+// End of the canary of a guarded block
+static char const *
+guard_canary_end(struct piggyback_data const *const pbdata, void const *const ptr)
+{
+	char const *const end = (char const *) ptr + pbdata->size;
+	
+	if (MEML_GUARD_PAGE == pbdata->guard) {
+		return (char const *) (((uintptr_t) end + guard_page_size() - 1) & ~(uintptr_t) (guard_page_size() - 1));
+	}
+	
+	return end + GUARD_CANARY_SIZE;
+}
+
+
+// Checks the canary of a guarded block and reports an overrun
+static void
+guard_check(struct piggyback_data const *const pbdata, void const *const ptr)
+{
+	unsigned char const *const end = (unsigned char const *) guard_canary_end(pbdata, ptr);
+	unsigned char const *it = (unsigned char const *) ptr + pbdata->size;
+	char name[SITE_NAME_MAX];
+	
+	while (it < end  &&  GUARD_CANARY_BYTE == *it) {
+		++it;
+	}
+	
+	if (it == end) {
+		return;
+	}
+	
+	__atomic_fetch_add(&pbdata->record->overruns, 1, __ATOMIC_RELAXED);
+	
+	ml_log(SS_TRACE ": Overrun of %lu byte block %p at byte %lu, allocated at %s\n", pbdata->size, ptr,
+		(unsigned long) (it - (unsigned char const *) ptr), site_name(pbdata->record, name, sizeof(name)));
+	
+	if (pbdata->record->stack) {
+		stack_report(pbdata->record->stack);
+	}
+}
+
+
+// Gives a guarded block back, once its header is no longer needed
+static void
+guard_free(struct piggyback_data const *const pbdata, void const *const ptr)
+{
+	if (MEML_GUARD_PAGE == pbdata->guard) {
+		char *const mem = (char *) pbdata->block;
+		
+		munmap(mem, guard_canary_end(pbdata, ptr) - mem + guard_page_size());
+	}
+	else {
+		real_free(pbdata->block);
+	}
+}
+
+
+/****************************************************************************
+   FORK AND SIGNALS
+*****************************************************************************/
+
+/***** Fork and signals *****************************************************
+ *
+ * A forked child has only the thread that called fork(). Locks held by 
+ * other threads at the moment stay locked in the child, so the child sets
+ * them up anew. What they guard is published lock-free, a child sees it 
+ * whole even if the lock was held. Buffered output is the parent's to 
+ * write; the child drops it and starts its own writer and watcher threads.
+ * 
+ * Reports on signals must not lock, allocate nor use stdio. The safe report
+ * sums the counters of all sites like a snapshot does, formats them by 
+ * hand in a buffer set aside in advance and writes it out with write(2).
+ * Sites without a file show their return address only, and stacks their
+ * addresses; resolve them with addr2line. On a fatal signal the previous
+ * action is restored and the signal raised again after the report, so core
+ * dumps and other handlers work as before.
+ * 
+*****************************************************************************/
+
+#define SAFE_REPORT_BUF  4096
+
+struct safe_report
+{
+	int    fd;
+	size_t len;
+	char   buf[SAFE_REPORT_BUF];
+};
+
+static struct safe_report safe_report_out;
+static bool               safe_report_busy;
+static struct sigaction   report_old_actions[NSIG];
+
+
+static void
+safe_flush(struct safe_report *const out)
+{
+	fd_write(out->fd, out->buf, out->len);
+	out->len = 0;
+}
+
+
+static void
+safe_puts(struct safe_report *const out, char const *str)
+{
+	while (*str) {
+		if (SAFE_REPORT_BUF == out->len) {
+			safe_flush(out);
+		}
+		out->buf[out->len++] = *str++;
+	}
+}
+
+
+// Appends a number in the given base, at least 'width' characters wide
+static void
+safe_putn(struct safe_report *const out, unsigned long value, unsigned int const base, int width, bool const negative)
+{
+	char digits[24];
+	int len = 0;
+	
+	do {
+		digits[len++] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value);
+	
+	if (negative) {
+		digits[len++] = '-';
+	}
+	
+	while (width-- > len) {
+		safe_puts(out, " ");
+	}
+	
+	while (len > 0) {
+		char const digit[2] = { digits[--len], '\0' };
+		
+		safe_puts(out, digit);
+	}
+}
+
+
+static void
+safe_putl(struct safe_report *const out, long const value, int const width)
+{
+	safe_putn(out, value < 0 ? -(unsigned long) value : value, 10, width, value < 0);
+}
+
+
+static void
+safe_putp(struct safe_report *const out, void const *const ptr)
+{
+	safe_puts(out, "0x");
+	safe_putn(out, (uintptr_t) ptr, 16, 0, false);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Writes a report of all sites without locking, allocating or stdio. 
+	Safe to call from a signal handler and in a forked child. A report 
+	asked for while another one is being written is skipped.
+  
+  Wants:
+    fd    - Where to write, f.ex. STDERR_FILENO. -1 for the log.
+	title - Heading of the report.
+	sig   - Signal the report is written on, added to the heading, or 0.
+	
+  Gives: 
+    Nothing.
+----------------------------------------------------------------------------*/
+
+static void
+safe_report_write(int const fd, char const *const title, int const sig)
+{
+	struct safe_report *const out = &safe_report_out;
+	struct alloc_record const *list_it;
+	
+	if (__atomic_test_and_set(&safe_report_busy, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	
+	// The log must be opened in advance, memleak_report_on_signal() does it
+	out->fd  = fd >= 0 ? fd : log_fd >= 0 ? log_fd : STDERR_FILENO;
+	out->len = 0;
+	
+	safe_puts(out, SS_TRACE ": ");
+	safe_puts(out, title);
+	
+	if (sig) {
+		safe_puts(out, " on signal ");
+		safe_putl(out, sig, 0);
+	}
+	
+	safe_puts(out, "\n");
+	
+	list_for_each(list_it)
+	{
+		struct alloc_counters sum;
+		long cnt;
+		size_t bytes;
+		unsigned int i;
+		
+		record_sum(list_it, &sum);
+		record_estimate(&sum, &cnt, &bytes);
+		
+		safe_puts(out, SS_TRACE ": ");
+		safe_putl(out, cnt, 4);
+		safe_puts(out, " records, ");
+		safe_putl(out, (long) bytes, 7);
+		safe_puts(out, " bytes from line ");
+		
+		if (list_it->file) {
+			safe_puts(out, list_it->file);
+			safe_puts(out, ": ");
+			safe_putl(out, list_it->line, 0);
+		}
+		else {
+			safe_puts(out, "[");
+			safe_putp(out, list_it->caller);
+			safe_puts(out, "]");
+		}
+		
+		if (list_it->epoch) {
+			safe_puts(out, " [");
+			safe_puts(out, list_it->epoch->name);
+			safe_puts(out, "]");
+		}
+		
+		safe_puts(out, list_it->overallocations ? "  (OA)\n" : "\n");
+		
+		for (i = 0; list_it->stack  &&  i < list_it->stack->depth; ++i) {
+			safe_puts(out, SS_TRACE ":        #");
+			safe_putl(out, i, 0);
+			safe_puts(out, " ");
+			safe_putp(out, list_it->stack->pc[i]);
+			safe_puts(out, "\n");
+		}
+	}
+	
+	safe_flush(out);
+	__atomic_clear(&safe_report_busy, __ATOMIC_RELEASE);
+}
+
+
+void
+memleak_report_safe(int const fd)
+{
+	safe_report_write(fd, __FUNCTION__, 0);
+}
+
+
+static bool
+signal_is_fatal(int const sig)
+{
+	return SIGSEGV == sig  ||  SIGBUS == sig  ||  SIGILL == sig  ||  SIGFPE == sig  ||  SIGABRT == sig;
+}
+
+
+static void
+report_signal_handler(int const sig)
+{
+	int const saved_errno = errno;
+	
+	// Not waiting, the drainer may be the thread that died
+	streams_drain(false);
+	safe_report_write(-1, "memleak_report", sig);
+	
+	if (signal_is_fatal(sig)) {
+		sigaction(sig, &report_old_actions[sig], NULL);
+		raise(sig);
+	}
+	
+	errno = saved_errno;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Writes a safe report to the log when the signal is caught. After a 
+	fatal signal (SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT) the previous 
+	action takes over; on others the application goes on. 
+  
+  Wants:
+    sig - The signal, f.ex. SIGUSR1.
+	
+  Gives: 
+    0 on success, -1 if the handler could not be installed.
+----------------------------------------------------------------------------*/
+
+int
+memleak_report_on_signal(int const sig)
+{
+	struct sigaction action;
+	
+	if (sig <= 0  ||  sig >= NSIG) {
+		return -1;
+	}
+	
+	pthread_once(&log_once, ml_log_open);
+	
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = report_signal_handler;
+	action.sa_flags   = SA_RESTART | SA_ONSTACK;
+	sigemptyset(&action.sa_mask);
+	
+	return sigaction(sig, &action, &report_old_actions[sig]) ? -1 : 0;
+}
+
+
+#define REPORT_SIGNAL_STACK  65536
+
+
+// Gives the calling thread an alternate signal stack, so that a crash 
+// report can be written after a stack overflow. Other threads report on 
+// their own stacks.
+static void
+report_signal_stack(void)
+{
+	stack_t stack;
+	
+	if (0 == sigaltstack(NULL, &stack)  &&  !(stack.ss_flags & SS_DISABLE)) {
+		return;
+	}
+	
+	void *const mem = mmap(NULL, REPORT_SIGNAL_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	
+	if (MAP_FAILED == mem) {
+		return;
+	}
+	
+	stack.ss_sp    = mem;
+	stack.ss_size  = REPORT_SIGNAL_STACK;
+	stack.ss_flags = 0;
+	
+	if (sigaltstack(&stack, NULL)) {
+		munmap(mem, REPORT_SIGNAL_STACK);
+	}
+}
+
+
+// Reports on all fatal signals
+int
+memleak_report_on_crash(void)
+{
+	int const fatal[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+	int result = 0;
+	unsigned int i;
+	
+	report_signal_stack();
+	
+	for (i = 0; i < sizeof(fatal) / sizeof(fatal[0]); ++i) {
+		result |= memleak_report_on_signal(fatal[i]);
+	}
+	
+	return result;
+}
+
+
+static void
+fork_child(void)
+{
+#ifdef SS_MEMTRACE_THREADSAFE
+	pthread_mutex_init(&rec_lock, NULL);
+	pthread_mutex_init(&report_lock, NULL);
+#endif
+	pthread_mutex_init(&watch_lock, NULL);
+	
+	__atomic_clear(&safe_report_busy, __ATOMIC_RELAXED);
+	streams_fork_child();
+	
+	if (watch_started) {
+		watch_start();
+	}
+}
+
+
+class ForkSignalSetup
+{
+public:
+	ForkSignalSetup()
+	{
+		pthread_atfork(NULL, NULL, fork_child);
+#ifdef SS_MEMTRACE_REPORT_SIGNAL
+		memleak_report_on_signal(SS_MEMTRACE_REPORT_SIGNAL);
+#endif
+#ifdef SS_MEMTRACE_REPORT_CRASH
+		memleak_report_on_crash();
+#endif
+	}
+};
+
+static ForkSignalSetup ForkSignals;
+
+
+/****************************************************************************
+   MEMORY ALLOCATION
+*****************************************************************************/
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Allocates memory block whose size is according to application's desire +
+	the size of piggyback block. Updates the bookkeeping and puts the 
+	record's pointer in the head of the allocated block.
+  
+	When sampling, unsampled allocations are passed to the C library as such.
+  
+  Wants:
+    size   - The amount of memory the application wants.
+	align  - Alignment of the block, a power of two. 0 for malloc's.
+	record - The site from where it wants it from, or NULL to look it up 
+	         by caller.
+	caller - Return address of the allocation.
+	frame  - Frame address of the allocator the application called, where
+	         the call stack is walked from.
+	
+  Gives: 
+    Pointer to the allocated memory shifted by the size of piggyback block.
+----------------------------------------------------------------------------*/
+
+static void *
+get_memory(size_t const size, size_t const align, struct alloc_record *record, void const *const caller, 
+	void const *const frame)
+{
+	if (sample_skip(size)) {
+		return real_alloc(size, align);
+	}
+	
+	struct alloc_epoch const *const epoch = thread_epoch;
+	
+	if (__atomic_load_n(&ss_memleak_stack_depth, __ATOMIC_RELAXED) > 0) {
+		struct alloc_stack const *const stack = stack_capture(frame);
+		
+		if (stack) {
+			record = record ? site_find_or_add(record->file, record->line, NULL, stack, epoch) : 
+				site_find_or_add(NULL, 0, caller, stack, epoch);
+		}
+	}
+	
+	if (!record) {
+		record = site_find_or_add(NULL, 0, caller, NULL, epoch);
+	}
+	else if (record->epoch != epoch) {
+		// The site's own record in the thread's epoch
+		record = site_find_or_add(record->file, record->line, record->caller, record->stack, epoch);
+	}
+	
+	// The piggyback is padded up to the alignment, to keep the user's block aligned
+	size_t const offset = align > PIGGYBACK_ALIGN ? (PIGGYBACK_SIZE + align - 1) & ~(align - 1) : PIGGYBACK_SIZE;
+	int guard = __atomic_load_n(&record->guard, __ATOMIC_RELAXED);
+	
+	// Page guards can't keep a block aligned past a page
+	if (MEML_GUARD_PAGE == guard  &&  align > guard_page_size()) {
+		guard = MEML_GUARD_CANARY;
+	}
+	
+	void *block;
+	void *const user_ptr = guard_alloc(size, offset, align, guard, &block);
+	bool const overalloc = ss_alloc_max_tolerate > 0  &&  size > ss_alloc_max_tolerate;
+	char name[SITE_NAME_MAX];
+	
+	if (overalloc) {
+		ml_log(SS_TRACE ": Allocation size (%lu) exceeded tolerance level at %s\n", size, site_name(record, name, sizeof(name)));
+	}
+	
+	if (!user_ptr) {
+		ml_log(SS_TRACE ": Could not allocate memory at %s\n", site_name(record, name, sizeof(name)));
+		return NULL;
+	}
+	
+	record_count(record, 1, size);
+	record_count_alloc(record, size);
+	heap_count(1, size, record_count_sample(record, 1, size));
+	
+	if (overalloc) {
+		__atomic_store_n(&record->overallocations, true, __ATOMIC_RELAXED);
+	}
+	
+	// Store the record's pointer in the head of the allocated memory area
+	struct piggyback_data *const pbdata = block_header(user_ptr);
+	pbdata->record = record;
+	pbdata->size   = size;
+	pbdata->block  = block;
+	pbdata->guard  = guard;
+	pbdata->thread = ml_thread_id();
+	pbdata->magic  = PIGGYBACK_MAGIC;
+#ifdef SS_MEMTRACE_LIFETIMES
+	pbdata->born   = event_ticks();
+#endif
+	
+	if (__atomic_load_n(&events_on, __ATOMIC_RELAXED)) {
+		event_emit(MLEV_ALLOC, record, user_ptr, size);
+	}
+	
+	return user_ptr;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Checks if the given pointer is allocated by bookkeeper. (This is told
+	by the magic word in front of the block.)
+	Updates bookkeeping and frees the memory.
+	The memory is freed even when it's not originally alloated by the book-
+	keeper process.
+  
+  Wants:
+    ptr - The application's view of the memory it wants freed.
+	
+  Gives: 
+    True - The memory was originally allocated by the bookkeeper.
+	False - The memory was _not_ originally ...
+----------------------------------------------------------------------------*/
+
+static bool
+free_memory(void *const ptr)
+{
+	struct piggyback_data *const pbdata = owned_block(ptr);
+	
+	if (pbdata) {
+		record_count(pbdata->record, -1, -(long) pbdata->size);
+		record_count_free(pbdata->record, pbdata->thread);
+		heap_count(-1, pbdata->size, record_count_sample(pbdata->record, -1, pbdata->size));
+#ifdef SS_MEMTRACE_LIFETIMES
+		record_count_lifetime(pbdata->record, event_ticks() - pbdata->born);
+#endif
+		
+		if (__atomic_load_n(&events_on, __ATOMIC_RELAXED)) {
+			event_emit(MLEV_FREE, pbdata->record, ptr, pbdata->size);
+		}
+		
+		if (pbdata->guard) {
+			guard_check(pbdata, ptr);
+		}
+		
+		// A stale header must not pass for ours after the memory is reused
+		pbdata->magic = 0;
+		
+		if (pbdata->guard) {
+			guard_free(pbdata, ptr);
+		}
+		else {
+			real_free(pbdata->block);
+		}
+		
+		return true;
+	}
+	
+	// This memory was not allocated by us, but we need to free it anyway
+	real_free(ptr);
+	return false;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does: 
+    Changes the size of a block like realloc. Our blocks are resized by the
+	C library together with their piggyback, in place whenever it can, and
+	stay counted at the site they were allocated from. The site's memory 
+	total changes by the difference of the sizes.
+	Blocks not allocated by us are passed to the C library.
+  
+  Wants:
+    ptr    - The application's block, or NULL to allocate a new one.
+	size   - The new size. 0 frees the block.
+	record - The site for a new block, or NULL to look it up by caller.
+	caller - Return address of the allocation.
+	frame  - Frame address of the allocator the application called.
+	
+  Gives: 
+    Pointer to the resized block, or NULL if memory ran out. The old block
+	is then left as it was.
+----------------------------------------------------------------------------*/
+
+static void *
+resize_memory(void *const ptr, size_t const size, struct alloc_record *const record, void const *const caller, 
+	void const *const frame)
+{
+	struct piggyback_data *pbdata = owned_block(ptr);
+	
+	if (!ptr) {
+		return get_memory(size, 0, record, caller, frame);
+	}
+	
+	if (!pbdata) {
+		return real_realloc(ptr, size);
+	}
+	
+	if (0 == size) {
+		free_memory(ptr);
+		return NULL;
+	}
+	
+	struct alloc_record *const owner = pbdata->record;
+	size_t const old_size = pbdata->size;
+	size_t const offset   = (char *) ptr - (char *) pbdata->block;
+	
+	bool const events = __atomic_load_n(&events_on, __ATOMIC_RELAXED);
+	void *new_ptr;
+	
+	if (offset + size < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	
+	// Once the block has moved another thread may get its address, and its 
+	// allocation must not come before our free in the event stream
+	if (events) {
+		event_emit(MLEV_FREE, owner, ptr, old_size);
+	}
+	
+	if (pbdata->guard) {
+		// Guarded blocks are moved, with a new guard behind them
+		void *block;
+		
+		guard_check(pbdata, ptr);
+		new_ptr = guard_alloc(size, offset, 0, pbdata->guard, &block);
+		
+		if (!new_ptr) {
+			if (events) {
+				event_emit(MLEV_ALLOC, owner, ptr, old_size);
+			}
+			errno = ENOMEM;
+			return NULL;
+		}
+		
+		memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+		*block_header(new_ptr) = *pbdata;
+		pbdata->magic = 0;
+		guard_free(pbdata, ptr);
+		
+		pbdata = block_header(new_ptr);
+		pbdata->size  = size;
+		pbdata->block = block;
+	}
+	else {
+		// If the block moves, the old copy must not pass for ours
+		pbdata->magic = 0;
+		
+		char *const block = (char *) real_realloc(pbdata->block, offset + size);
+		
+		if (!block) {
+			pbdata->magic = PIGGYBACK_MAGIC;
+			if (events) {
+				event_emit(MLEV_ALLOC, owner, ptr, old_size);
+			}
+			return NULL;
+		}
+		
+		new_ptr = block + offset;
+		
+		pbdata = block_header(new_ptr);
+		pbdata->size  = size;
+		pbdata->block = block;
+		pbdata->magic = PIGGYBACK_MAGIC;
+	}
+	
+	record_count(owner, 0, (long) size - (long) old_size);
+	heap_count(-1, old_size, record_count_sample(owner, -1, old_size));
+	heap_count(1, size, record_count_sample(owner, 1, size));
+	
+	if (events) {
+		event_emit(MLEV_ALLOC, owner, new_ptr, size);
+	}
+	
+	return new_ptr;
+}
+
+
+/****************************************************************************
+   REPLACEMENT ALLOCATORS
+*****************************************************************************/
+
+void *
+ss_malloc(size_t const size, char const *const file, int const line)
+{
+	if (!tracking_on()) {
+		return real_malloc(size);
+	}
+	
+	return ss_malloc_at(size, site_find_or_add(file, line, NULL, NULL, NULL));
+}
+
+void *
+ss_malloc_at(size_t const size, struct alloc_record *const record)
+{
+	if (!tracking_on()) {
+		return real_malloc(size);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": malloc(%lu) from %s: %d\n", size, record->file, record->line);
+#endif
+	
+	return get_memory(size, 0, record, NULL, __builtin_frame_address(0));
+}
+
+void
+ss_free(void *ptr)
+{
+	const bool alloc_by_us = free_memory(ptr);
+#ifdef SS_MEMTRACE_VERBOSE
+	if (alloc_by_us) {
+		ml_log(SS_TRACE ": free(%p)\n", ptr);
+	}
+#endif
+	(void) alloc_by_us;
+}
+
+void *
+ss_calloc_at(size_t const nmemb, size_t const size, struct alloc_record *const record)
+{
+	if (!tracking_on()) {
+		return real_calloc(nmemb, size);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": calloc(%lu, %lu) from %s: %d\n", nmemb, size, record->file, record->line);
+#endif
+	
+	if (size  &&  nmemb > (size_t) -1 / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	
+	void *const ptr = get_memory(nmemb * size, 0, record, NULL, __builtin_frame_address(0));
+	
+	if (ptr) {
+		memset(ptr, 0, nmemb * size);
+	}
+	
+	return ptr;
+}
+
+void *
+ss_realloc_at(void *const ptr, size_t const size, struct alloc_record *const record)
+{
+	// Our blocks must be resized by us even when tracking has been turned off
+	if (!tracking_on()  &&  !owned_block(ptr)) {
+		return real_realloc(ptr, size);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": realloc(%p, %lu) from %s: %d\n", ptr, size, record->file, record->line);
+#endif
+	
+	return resize_memory(ptr, size, record, NULL, __builtin_frame_address(0));
+}
+
+void *
+ss_aligned_alloc_at(size_t const align, size_t const size, struct alloc_record *const record)
+{
+	if (0 == align  ||  (align & (align - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	
+	if (!tracking_on()) {
+		return real_alloc(size, align);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": aligned_alloc(%lu, %lu) from %s: %d\n", align, size, record->file, record->line);
+#endif
+	
+	return get_memory(size, align, record, NULL, __builtin_frame_address(0));
+}
+
+int
+ss_posix_memalign_at(void **const ptr, size_t const align, size_t const size, struct alloc_record *const record)
+{
+	if (0 == align  ||  align % sizeof(void *)  ||  (align & (align - 1))) {
+		return EINVAL;
+	}
+	
+	if (!tracking_on()) {
+		return real_posix_memalign(ptr, align, size);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": posix_memalign(%lu, %lu) from %s: %d\n", align, size, record->file, record->line);
+#endif
+	
+	void *const mem = get_memory(size, align, record, NULL, __builtin_frame_address(0));
+	
+	if (!mem) {
+		return ENOMEM;
+	}
+	
+	*ptr = mem;
+	return 0;
+}
+
+void* 
+operator new (size_t const size, ss_new_t, char const *const file, int const line)
+{
+	if (!tracking_on()) {
+		return real_malloc(size);
+	}
+	
+	return operator new (size, ss_new, site_find_or_add(file, line, NULL, NULL, NULL));
+}
+
+void *
+operator new (size_t const size, ss_new_t, struct alloc_record *const record)
+{
+	if (!tracking_on()) {
+		return real_malloc(size);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": new(%lu) from %s: %d\n", size, record->file, record->line);
+#endif
+	
+	return get_memory(size, 0, record, NULL, __builtin_frame_address(0));
+}
+
+void
+operator delete (void *const ptr)
+{
+	const bool alloc_by_us = free_memory(ptr);
+#ifdef SS_MEMTRACE_VERBOSE
+	if (alloc_by_us) {
+		ml_log(SS_TRACE ": delete(%p)\n", ptr);
+	}
+#endif
+	(void) alloc_by_us;
+}
+
+// C++14 sized deallocation. The size should be the one allocated.
+void
+operator delete (void *const ptr, size_t const size)
+{
+#ifdef SS_MEMTRACE_VERBOSE
+	struct piggyback_data const *const pbdata = owned_block(ptr);
+	
+	if (pbdata  &&  pbdata->size != size) {
+		ml_log(SS_TRACE ": delete(%p) of %lu bytes, allocated %lu\n", ptr, size, pbdata->size);
+	}
+#endif
+	(void) size;
+	operator delete (ptr);
+}
+
+void *
+operator new [] (size_t const size, ss_new_t, char const *const file, int const line)
+{
+	if (!tracking_on()) {
+		return real_malloc(size);
+	}
+	
+	return operator new [] (size, ss_new, site_find_or_add(file, line, NULL, NULL, NULL));
+}
+
+void *
+operator new [] (size_t const size, ss_new_t, struct alloc_record *const record)
+{
+	if (!tracking_on()) {
+		return real_malloc(size);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": new[](%lu) from %s: %d\n", size, record->file, record->line);
+#endif
+	
+	return get_memory(size, 0, record, NULL, __builtin_frame_address(0));
+}
+
+void
+operator delete [] (void *const ptr)
+{
+	const bool alloc_by_us = free_memory(ptr);
+#ifdef SS_MEMTRACE_VERBOSE
+	if (alloc_by_us) {
+		ml_log(SS_TRACE ": delete[](%p)\n", ptr);
+	}
+#endif
+	(void) alloc_by_us;
+}
+
+// C++14 sized deallocation of arrays
+void
+operator delete [] (void *const ptr, size_t const size)
+{
+#ifdef SS_MEMTRACE_VERBOSE
+	struct piggyback_data const *const pbdata = owned_block(ptr);
+	
+	if (pbdata  &&  pbdata->size != size) {
+		ml_log(SS_TRACE ": delete[](%p) of %lu bytes, allocated %lu\n", ptr, size, pbdata->size);
+	}
+#endif
+	(void) size;
+	operator delete [] (ptr);
+}
+
+#ifdef __cpp_aligned_new
+
+// Types aligned beyond malloc's alignment, with C++17 and newer
+
+void *
+operator new (size_t const size, std::align_val_t const align, ss_new_t, struct alloc_record *const record)
+{
+	if (!tracking_on()) {
+		return real_alloc(size, (size_t) align);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": new(%lu, %lu) from %s: %d\n", size, (size_t) align, record->file, record->line);
+#endif
+	
+	return get_memory(size, (size_t) align, record, NULL, __builtin_frame_address(0));
+}
+
+void *
+operator new [] (size_t const size, std::align_val_t const align, ss_new_t, struct alloc_record *const record)
+{
+	if (!tracking_on()) {
+		return real_alloc(size, (size_t) align);
+	}
+#ifdef SS_MEMTRACE_VERBOSE
+	ml_log(SS_TRACE ": new[](%lu, %lu) from %s: %d\n", size, (size_t) align, record->file, record->line);
+#endif
+	
+	return get_memory(size, (size_t) align, record, NULL, __builtin_frame_address(0));
+}
+
+void
+operator delete (void *const ptr, std::align_val_t)
+{
+	operator delete (ptr);
+}
+
+void
+operator delete (void *const ptr, size_t, std::align_val_t)
+{
+	operator delete (ptr);
+}
+
+void
+operator delete [] (void *const ptr, std::align_val_t)
+{
+	operator delete [] (ptr);
+}
+
+void
+operator delete [] (void *const ptr, size_t, std::align_val_t)
+{
+	operator delete [] (ptr);
+}
+
+#endif  // __cpp_aligned_new
+
+
+/****************************************************************************
+   PRELOADED ALLOCATORS
+*****************************************************************************/
+
+#ifdef SS_MEMLEAK_PRELOAD
+
+/***** Preloaded allocators *************************************************
+ *
+ * These replace the C library's allocators and the global operator new of 
+ * the application. Sites are identified by the return address of the 
+ * allocation call. Allocations made while memleak is busy with its own 
+ * bookkeeping (f.ex. the C library allocating on our behalf) go straight
+ * to the C library.
+ * 
+ * Blocks of realloc stay counted at the site they were allocated from.
+ * 
+*****************************************************************************/
+
+#define preload_tracking()  (tracking_on()  &&  !in_memleak  &&  allocators_ready())
+
+
+// Return and frame address of the allocator the application called
+#define CALL_SITE  __builtin_return_address(0), __builtin_frame_address(0)
+
+
+static void *
+preload_alloc(size_t const size, size_t const align, void const *const caller, void const *const frame)
+{
+	ml_busy(true);
+	void *const ptr = get_memory(size, align, NULL, caller, frame);
+	ml_busy(false);
+	
+	return ptr;
+}
+
+
+extern "C" {
+
+void *
+malloc(size_t const size)
+{
+	if (!preload_tracking()) {
+		return real_malloc(size);
+	}
+	
+	return preload_alloc(size, 0, CALL_SITE);
+}
+
+void *
+calloc(size_t const nmemb, size_t const size)
+{
+	if (!preload_tracking()) {
+		return real_calloc(nmemb, size);
+	}
+	
+	if (size  &&  nmemb > (size_t) -1 / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	
+	void *const ptr = preload_alloc(nmemb * size, 0, CALL_SITE);
+	
+	if (ptr) {
+		memset(ptr, 0, nmemb * size);
+	}
+	
+	return ptr;
+}
+
+void *
+realloc(void *const ptr, size_t const size)
+{
+	void *new_ptr;
+	
+	if (is_bootstrap_ptr(ptr)) {
+		// Size of an arena block is unknown, copy what's left of the arena
+		size_t const left = bootstrap_arena + BOOTSTRAP_ARENA_SIZE - (char *) ptr;
+		
+		new_ptr = real_malloc(size);
+		if (new_ptr) {
+			memcpy(new_ptr, ptr, size < left ? size : left);
+		}
+		return new_ptr;
+	}
+	
+	// Our blocks are resized by us even when not tracking
+	if (!preload_tracking()) {
+		return owned_block(ptr) ? resize_memory(ptr, size, NULL, CALL_SITE) : real_realloc(ptr, size);
+	}
+	
+	ml_busy(true);
+	new_ptr = resize_memory(ptr, size, NULL, CALL_SITE);
+	ml_busy(false);
+	
+	return new_ptr;
+}
+
+int
+posix_memalign(void **const ptr, size_t const align, size_t const size)
+{
+	if (0 == align  ||  align % sizeof(void *)  ||  (align & (align - 1))) {
+		return EINVAL;
+	}
+	
+	if (!preload_tracking()) {
+		return real_posix_memalign(ptr, align, size);
+	}
+	
+	void *const mem = preload_alloc(size, align, CALL_SITE);
+	
+	if (!mem) {
+		return ENOMEM;
+	}
+	
+	*ptr = mem;
+	return 0;
+}
+
+void *
+aligned_alloc(size_t const align, size_t const size)
+{
+	if (0 == align  ||  (align & (align - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	
+	return preload_tracking() ? preload_alloc(size, align, CALL_SITE) : real_alloc(size, align);
+}
+
+void *
+memalign(size_t const align, size_t const size)
+{
+	if (0 == align  ||  (align & (align - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	
+	return preload_tracking() ? preload_alloc(size, align, CALL_SITE) : real_alloc(size, align);
+}
+
+void
+free(void *const ptr)
+{
+	if (ptr  &&  !is_bootstrap_ptr(ptr)) {
+		free_memory(ptr);
+	}
+}
+
+size_t
+malloc_usable_size(void *const ptr)
+{
+	struct piggyback_data *pbdata;
+	
+	if (!ptr  ||  is_bootstrap_ptr(ptr)) {
+		return 0;
+	}
+	
+	pbdata = owned_block(ptr);
+	
+	// The application must not write over the canary of a guarded block
+	if (pbdata  &&  pbdata->guard) {
+		return pbdata->size;
+	}
+	
+	if (pbdata) {
+		return real_usable_size(pbdata->block) - ((char *) ptr - (char *) pbdata->block);
+	}
+	
+	return real_usable_size(ptr);
+}
+
+}  // extern "C"
+
+
+void *
+operator new (size_t const size)
+{
+	void *const ptr = preload_tracking() ? preload_alloc(size, 0, CALL_SITE) : real_malloc(size);
+	
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	
+	return ptr;
+}
+
+void *
+operator new [] (size_t const size)
+{
+	void *const ptr = preload_tracking() ? preload_alloc(size, 0, CALL_SITE) : real_malloc(size);
+	
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	
+	return ptr;
+}
+
+void *
+operator new (size_t const size, std::nothrow_t const &) throw()
+{
+	return preload_tracking() ? preload_alloc(size, 0, CALL_SITE) : real_malloc(size);
+}
+
+void *
+operator new [] (size_t const size, std::nothrow_t const &) throw()
+{
+	return preload_tracking() ? preload_alloc(size, 0, CALL_SITE) : real_malloc(size);
+}
+
+void
+operator delete (void *const ptr, std::nothrow_t const &) throw()
+{
+	free_memory(ptr);
+}
+
+void
+operator delete [] (void *const ptr, std::nothrow_t const &) throw()
+{
+	free_memory(ptr);
+}
+
+#ifdef __cpp_aligned_new
+
+void *
+operator new (size_t const size, std::align_val_t const align)
+{
+	void *const ptr = preload_tracking() ? preload_alloc(size, (size_t) align, CALL_SITE) : real_alloc(size, (size_t) align);
+	
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	
+	return ptr;
+}
+
+void *
+operator new [] (size_t const size, std::align_val_t const align)
+{
+	void *const ptr = preload_tracking() ? preload_alloc(size, (size_t) align, CALL_SITE) : real_alloc(size, (size_t) align);
+	
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	
+	return ptr;
+}
+
+#endif  // __cpp_aligned_new
+
+
+// Tracking is on from the start. MEMLEAK_EVENTS=<file> records events,
+// MEMLEAK_STACK_DEPTH=<n> tells sites apart by n return addresses,
+// MEMLEAK_HEAP_LIMIT=<bytes> reports when the heap grows over the limit,
+// MEMLEAK_SHM=1 keeps the counters in shared memory for memleak-top,
+// MEMLEAK_GUARD=canary|page guards all blocks, MEMLEAK_REPORT_SIGNAL=<n>
+// writes a report on signal n and MEMLEAK_REPORT_CRASH=1 on fatal signals.
+class PreloadInit
+{
+public:
+	PreloadInit()
+	{
+		char const *const events = getenv("MEMLEAK_EVENTS");
+		char const *const depth  = getenv("MEMLEAK_STACK_DEPTH");
+		char const *const heap_limit = getenv("MEMLEAK_HEAP_LIMIT");
+		char const *const shm = getenv("MEMLEAK_SHM");
+		char const *const guard = getenv("MEMLEAK_GUARD");
+		char const *const report_signal = getenv("MEMLEAK_REPORT_SIGNAL");
+		char const *const report_crash = getenv("MEMLEAK_REPORT_CRASH");
+		
+		allocators_ready();
+		
+		if (guard) {
+			memleak_guard(NULL, 0, !strcmp(guard, "page") ? MEML_GUARD_PAGE : 
+				!strcmp(guard, "canary") ? MEML_GUARD_CANARY : MEML_GUARD_NONE);
+		}
+		
+		if (depth) {
+			ss_memleak_stack_depth = strtoul(depth, NULL, 0);
+		}
+		
+		if (shm  &&  shm[0] != '\0'  &&  shm[0] != '0') {
+			memleak_shm_open();
+		}
+		
+		if (report_signal) {
+			memleak_report_on_signal(atoi(report_signal));
+		}
+		
+		if (report_crash  &&  report_crash[0] != '\0'  &&  report_crash[0] != '0') {
+			memleak_report_on_crash();
+		}
+		
+		if (heap_limit) {
+			struct memleak_watermarks marks;
+			
+			memset(&marks, 0, sizeof(marks));
+			marks.heap_bytes = strtoul(heap_limit, NULL, 0);
+			memleak_watermarks_set(&marks);
+		}
+		
+		ss_memleak_tracking = 1;
+		
+		if (events  &&  events[0] != '\0') {
+			memleak_events_open(events);
+		}
+	}
+};
+
+static PreloadInit Preload;
+
+#endif  // SS_MEMLEAK_PRELOAD
+
 #endif  // SS_ENABLE_MEMTRACE
@@ -31,16 +31,94 @@
 // Comment to leave timestamps out of the log output
 // #define SS_MEMTRACE_LOG_TIMESTAMP
 
+// Buffer log output in per-thread rings which a background thread writes
+// to SS_MEMTRACE_LOG. Makes SS_MEMTRACE_VERBOSE usable under load.
+// #define SS_MEMTRACE_LOG_ASYNC
+
+// Size of every thread's log ring in bytes. Must be a power of two.
+#define SS_MEMTRACE_LOG_RING  65536
+
+// Record every allocation and free in a binary event file for offline
+// analysis with memleak-analyze. See also memleak_events_open().
+// #define SS_MEMTRACE_EVENTS "/tmp/memleak.events"
+
+// Size of every thread's event ring in bytes. Must be a power of two.
+#define SS_MEMTRACE_EVENT_RING  262144
+
+// Keep the counters in shared memory from the start, for memleak-top.
+// See also memleak_shm_open().
+// #define SS_MEMTRACE_SHM
+
+// Number of sites the shared memory has room for
+#define SS_MEMTRACE_SHM_SITES  4096
+
 // Pretty self-explanatory
 #define SS_MEMTRACE_THREADSAFE
 
+// Stamp every block with its allocation time and count the lifetimes of
+// freed blocks per site. Costs a timestamp read per allocation and free.
+#define SS_MEMTRACE_LIFETIMES
+
+// Allocation sites are indexed in a hash table of 2^SS_MEMTRACE_HASH_BITS
+// buckets. Increase if your application has tens of thousands of sites.
+#define SS_MEMTRACE_HASH_BITS  12
+
+// Number of per-thread counter slots of every allocation site. Each thread
+// updates its own cache line, so tracking scales with the number of cores.
+// Set to 1 to keep a single slot per site and save memory.
+#define SS_MEMTRACE_SHARDS  16
+
 // You must set this to != 0 when you want tracking enabled!
+// Once threads are running, switch it with memleak_pause()/memleak_resume()
+// or track only regions, see MemleakRegion.
 extern unsigned int ss_memleak_tracking;
 
 // How big allocation is tolerated to not directly report it (0 = no limit)
 #define SS_ALLOC_MAX_TOLERATE_DEFAULT    0
 extern unsigned int ss_alloc_max_tolerate;
 
+// Track only a sample of allocations, on average one per this many bytes
+// allocated (0 = track all). Reports scale the counters up statistically.
+// Set before enabling tracking.
+#define SS_MEMTRACE_SAMPLE_PERIOD_DEFAULT  0
+extern unsigned long ss_memleak_sample_period;
+
+// Key allocation sites also by their call stack, this many return addresses
+// deep (0 = off). Needs code built with -fno-omit-frame-pointer.
+#define SS_MEMTRACE_STACK_DEPTH_DEFAULT  0
+extern unsigned int ss_memleak_stack_depth;
+
+// Blocks freed within this many microseconds are short-lived. Reports with
+// MEML_LIFETIMES rank sites by them.
+#define SS_MEMTRACE_SHORT_LIVED_US_DEFAULT  100
+extern unsigned long ss_memleak_short_lived_us;
+
+// Number of log2 size classes counted per allocation site. Class n holds
+// sizes 2^(n-1)..2^n-1, the last class all larger ones.
+#define SS_MEMTRACE_SIZE_CLASSES  20
+
+// Deepest call stack kept of an allocation site
+#define SS_MEMTRACE_STACK_MAX  16
+
+// Threads add their allocations to the process totals in batches of this 
+// many bytes, so the totals and peaks lag behind by a batch per thread
+#define SS_MEMTRACE_WATERMARK_BATCH  65536
+
+// How often the watcher thread checks the watermarks by default
+#define SS_MEMTRACE_WATERMARK_INTERVAL_MS  100
+
+// Threads told apart in MEML_THREADS reports, later ones are counted together
+#define SS_MEMTRACE_THREAD_MATRIX  16
+
+// Signal that writes a safe report, see memleak_report_on_signal()
+// #define SS_MEMTRACE_REPORT_SIGNAL  SIGUSR2
+
+// Write a safe report on fatal signals, see memleak_report_on_crash()
+// #define SS_MEMTRACE_REPORT_CRASH
+
+// Most rules of memleak_guard()
+#define SS_MEMTRACE_GUARD_RULES  16
+
 
 #ifdef SS_ENABLE_MEMTRACE
 
@@ -51,29 +129,215 @@ extern unsigned int ss_alloc_max_tolerate;
 #define MEML_TIGHT           0x1
 #define MEML_SUPPRESS_ZEROS  0x2
 #define MEML_ONLY_CHANGED    0x4
+#define MEML_SIZE_CLASSES    0x8  // Allocation rate and log2 size classes
+#define MEML_LIFETIMES       0x10 // Lifetimes of freed blocks, short-lived sites
+#define MEML_THREADS         0x20 // Cross-thread frees, frees by thread pairs
 
 void memleak_report(int flags = MEML_DEFAULT);
 
+struct alloc_record;
+struct alloc_epoch;
+
+// Prints only the sites of an epoch, NULL for allocations made in no epoch
+void memleak_epoch_report(struct alloc_epoch const *epoch, int flags = MEML_DEFAULT);
+
+// Counters of an allocation site, see memleak_sites()
+struct memleak_site
+{
+	char const *file;           // NULL for sites identified by return address
+	int        line;
+	void const *caller;         // Return address, when there's no file
+	char const *epoch;          // Epoch of the allocations, NULL for none
+	long       blocks;          // Live blocks, estimated when sampling
+	size_t     bytes;           // Live bytes, likewise
+	long       sampled_blocks;  // Live blocks tracked, when sampling
+	long       allocs;          // Allocations tracked
+	long       frees;           // Frees tracked
+	long       cross_frees;     // Frees by another thread than the allocating one
+	long       peak_blocks;     // Most live blocks seen by reports and the watcher
+	size_t     peak_bytes;      // Most live bytes, likewise
+	bool       overallocations;
+	long       overruns;        // Overruns found by guards, see memleak_guard()
+	struct alloc_record const *record;
+};
+
+typedef void (*memleak_site_fn)(struct memleak_site const *site, void *arg);
+
+// Calls fn for every allocation site, from a snapshot taken without 
+// blocking allocating threads. Returns the number of sites, -1 on error.
+int  memleak_sites(memleak_site_fn fn, void *arg);
+
+// Formats "file: line" or "object(symbol+offset) [address]" of a site
+char const *memleak_site_name(struct memleak_site const *site, char *buf, size_t size);
+
+// Live memory of the whole process, see SS_MEMTRACE_WATERMARK_BATCH
+struct memleak_heap
+{
+	long bytes;
+	long blocks;
+	long peak_bytes;
+	long peak_blocks;
+};
+
+void memleak_heap_usage(struct memleak_heap *heap);
+
+#define MEML_ALARM_BYTES   1  // Live bytes over the limit
+#define MEML_ALARM_BLOCKS  2  // Live blocks over the limit
+#define MEML_ALARM_GROWTH  3  // Live bytes grew faster than the limit per second
+
+struct memleak_alarm
+{
+	int  type;                        // MEML_ALARM_*
+	long value;
+	long limit;
+	struct memleak_site const *site;  // NULL for the whole process
+};
+
+typedef void (*memleak_alarm_fn)(struct memleak_alarm const *alarm, void *arg);
+
+// Limits checked by the watcher thread. 0 leaves a limit unchecked.
+struct memleak_watermarks
+{
+	size_t       heap_bytes;
+	long         heap_blocks;
+	size_t       heap_growth;   // Bytes per second
+	size_t       site_bytes;    // Limits of every single site
+	long         site_blocks;
+	size_t       site_growth;
+	unsigned int interval_ms;   // 0 for SS_MEMTRACE_WATERMARK_INTERVAL_MS
+	memleak_alarm_fn fn;        // Called in the watcher thread. NULL logs the
+	void         *arg;          // alarm and writes memleak_report().
+};
+
+// Sets the watermarks and starts the watcher thread. An alarm is raised
+// when a value goes over its limit. Returns 0 on success.
+int  memleak_watermarks_set(struct memleak_watermarks const *marks);
+
+// Switch tracking of the whole process atomically
+void memleak_pause(void);
+void memleak_resume(void);
+
+// Pause tracking in the calling thread. Pauses nest; a resume without a
+// pause is ignored.
+void memleak_thread_pause(void);
+void memleak_thread_resume(void);
+
+// Finds or creates a named epoch. Sites count the allocations made in an
+// epoch apart from the others.
+struct alloc_epoch *memleak_epoch(char const *name);
+
+// Tracks the calling thread's allocations until memleak_region_end(), 
+// even with ss_memleak_tracking off, in the given epoch if not NULL.
+// Returns the previous epoch for memleak_region_end(). Regions nest; an
+// end without a begin is ignored.
+struct alloc_epoch *memleak_region_begin(struct alloc_epoch *epoch);
+void memleak_region_end(struct alloc_epoch *prev);
+
+// Tracking region of a scope, f.ex. MemleakRegion region("request");
+class MemleakRegion
+{
+public:
+	MemleakRegion() : prev(memleak_region_begin(0)) { }
+	explicit MemleakRegion(struct alloc_epoch *epoch) : prev(memleak_region_begin(epoch)) { }
+	explicit MemleakRegion(char const *epoch) : prev(memleak_region_begin(memleak_epoch(epoch))) { }
+	~MemleakRegion() { memleak_region_end(prev); }
+
+private:
+	struct alloc_epoch *prev;
+
+	MemleakRegion(MemleakRegion const &);
+	MemleakRegion &operator=(MemleakRegion const &);
+};
+
+// Pauses tracking in the calling thread for a scope
+class MemleakPause
+{
+public:
+	MemleakPause() { memleak_thread_pause(); }
+	~MemleakPause() { memleak_thread_resume(); }
+
+private:
+	MemleakPause(MemleakPause const &);
+	MemleakPause &operator=(MemleakPause const &);
+};
+
+// Writes out buffered log output and events. Call from your signal handler
+// with SS_MEMTRACE_LOG_ASYNC or events, so nothing is lost when the app dies.
+// A stream whose drain the signal interrupted is left unwritten.
+void memleak_log_flush(void);
+
+// Writes a report of all sites with write(2) only, safe in signal handlers
+// and forked children. Sites without a file show their return address. 
+// fd -1 writes to the log.
+void memleak_report_safe(int fd);
+
+// Writes a safe report to the log when the signal is caught. After a fatal
+// signal the previous action takes over. Returns 0 on success.
+int  memleak_report_on_signal(int sig);
+
+// Same for SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT
+int  memleak_report_on_crash(void);
+
+// Starts recording allocation events in a binary file. Returns 0 on success.
+int  memleak_events_open(char const *path);
+
+// Keeps the counters of sites created from now on in shared memory, where
+// memleak-top reads them. Returns 0 on success.
+int  memleak_shm_open(void);
+
+#define MEML_GUARD_NONE    0
+#define MEML_GUARD_CANARY  1  // Canary behind the block, checked on free and realloc
+#define MEML_GUARD_PAGE    2  // Block ends at an inaccessible page, overruns fault
+
+// Guards the blocks allocated from now on at the sites of a file (or the end
+// of its name, NULL for all sites) and line (0 for all lines). The last 
+// matching rule wins. Returns 0 on success.
+int  memleak_guard(char const *file, int line, int mode);
+
 // Returns the number of active allocations made from the same line
 // as the ptr
 int  memleak_allocs_at(void const *ptr);
 
+#ifdef __cpp_aligned_new
+#include <new>
+#endif
+
 struct ss_new_t {};
 extern struct ss_new_t ss_new;
 
-struct alloc_record;
-
 struct alloc_record *ss_memleak_point_register(char const *file, int line);
 
 void *ss_malloc(size_t const size, char const *file, int line);
+void *ss_malloc_at(size_t const size, struct alloc_record *record);
+void *ss_calloc_at(size_t nmemb, size_t size, struct alloc_record *record);
+void *ss_realloc_at(void *ptr, size_t size, struct alloc_record *record);
+void *ss_aligned_alloc_at(size_t align, size_t size, struct alloc_record *record);
+int   ss_posix_memalign_at(void **ptr, size_t align, size_t size, struct alloc_record *record);
 void ss_free(void *ptr);
 
 void *operator new (size_t size, ss_new_t, char const *file, int line);
+void *operator new (size_t size, ss_new_t, struct alloc_record *record);
 void operator delete (void *ptr);
 
 void *operator new [] (size_t size, ss_new_t, char const *file, int line);
+void *operator new [] (size_t size, ss_new_t, struct alloc_record *record);
 void operator delete [] (void *ptr);
 
+#ifdef __cpp_sized_deallocation
+void operator delete (void *ptr, size_t size);
+void operator delete [] (void *ptr, size_t size);
+#endif
+
+#ifdef __cpp_aligned_new
+// Over-aligned types. The new macro gets these with C++17.
+void *operator new (size_t size, std::align_val_t align, ss_new_t, struct alloc_record *record);
+void *operator new [] (size_t size, std::align_val_t align, ss_new_t, struct alloc_record *record);
+void operator delete (void *ptr, std::align_val_t align);
+void operator delete (void *ptr, size_t size, std::align_val_t align);
+void operator delete [] (void *ptr, std::align_val_t align);
+void operator delete [] (void *ptr, size_t size, std::align_val_t align);
+#endif
+
 /***** NOTE *****************************************************************
  *
  * I have not yet found out how placement new could be replaced by a custom
@@ -93,12 +357,38 @@ void operator delete [] (void *ptr);
 
 #ifdef SS_ENABLE_MEMTRACE
 
+#if __cplusplus >= 201103L
+
+// Every expansion resolves its allocation site only once and keeps it in a
+// function-local static. Later calls go straight to the site's counters.
+#define SS_MEMLEAK_POINT() \
+	([]() -> struct alloc_record * { \
+		static struct alloc_record *const ss_point = ss_memleak_point_register(__FILE__, __LINE__); \
+		return ss_point; \
+	}())
+
+#define malloc(size) ss_malloc_at(size, SS_MEMLEAK_POINT())
+
+#define new new (ss_new, SS_MEMLEAK_POINT())
+
+#else
+
 #define malloc(size) ss_malloc(size, __FILE__, __LINE__)
-	
-#define free(ptr)    ss_free(ptr)
 
 #define new new (ss_new, __FILE__, __LINE__)
 
+// Looks up the site on every call
+#define SS_MEMLEAK_POINT() ss_memleak_point_register(__FILE__, __LINE__)
+
+#endif
+
+#define calloc(nmemb, size)             ss_calloc_at(nmemb, size, SS_MEMLEAK_POINT())
+#define realloc(ptr, size)              ss_realloc_at(ptr, size, SS_MEMLEAK_POINT())
+#define aligned_alloc(align, size)      ss_aligned_alloc_at(align, size, SS_MEMLEAK_POINT())
+#define posix_memalign(ptr, align, size) ss_posix_memalign_at(ptr, align, size, SS_MEMLEAK_POINT())
+
+#define free(ptr)    ss_free(ptr)
+
 #endif  // SS_ENABLE_MEMTRACE
 
 #endif  // SS_MEMLEAK_MACROS
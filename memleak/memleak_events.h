@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2010-2012 Sami Sorell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+
+#ifndef SS_MEMLEAK_EVENTS_H
+#define SS_MEMLEAK_EVENTS_H
+
+#include <stdint.h>
+
+/***** Event stream *********************************************************
+ *
+ * Layout of the binary event stream written by memleak_events_open().
+ * The file starts with a header, followed by records in native byte order.
+ * Every record is an mlev_event. A site record is followed by the site's
+ * name, 'address' bytes padded up to a multiple of 8.
+ * Records of different threads are written in chunks, so they are ordered
+ * by time only within a thread. Sort by 'ticks' before replaying.
+ *
+*****************************************************************************/
+
+#define MLEV_MAGIC    "MLEVENTS"
+#define MLEV_VERSION  1
+
+#define MLEV_SITE   1  // A new allocation site: 'site' = id, 'size' = line
+#define MLEV_ALLOC  2  // 'size' bytes allocated at 'address'
+#define MLEV_FREE   3  // Block at 'address' with 'size' bytes freed
+
+struct mlev_header
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t event_size;     // sizeof(struct mlev_event)
+	uint64_t ticks_per_sec;  // Conversion of 'ticks' to time
+	uint64_t start_ticks;    // Ticks when the stream was opened
+};
+
+struct mlev_event
+{
+	uint64_t ticks;
+	uint64_t address;
+	uint64_t size;
+	uint32_t site;
+	uint16_t thread;
+	uint8_t  type;
+	uint8_t  reserved;
+};
+
+#endif  // SS_MEMLEAK_EVENTS_H
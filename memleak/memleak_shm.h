@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2010-2012 Sami Sorell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+
+#ifndef SS_MEMLEAK_SHM_H
+#define SS_MEMLEAK_SHM_H
+
+#include <stdint.h>
+
+/***** Shared stats *********************************************************
+ *
+ * Layout of the shared memory segment of memleak_shm_open(), named
+ * MLSHM_NAME_FMT of the process id. The segment starts with a header,
+ * followed by 'max_sites' sites of 'site_size' bytes each. The first
+ * 'nr_sites' of them are in use; read it with acquire ordering, a site is
+ * filled in before it is counted.
+ * A site starts with an mlshm_site, followed by 'shards' counter slots of
+ * 'shard_size' bytes. The counters are native longs at the offsets given
+ * in the header, updated atomically by the process. Sum them up over the
+ * slots. When sampling, 'est_blocks' / 'est_one' and 'est_bytes' are the
+ * estimates; they are zero otherwise.
+ * Readers must check 'version' and use the sizes and offsets of the
+ * header instead of their own.
+ *
+*****************************************************************************/
+
+#define MLSHM_MAGIC     "MLSHARED"
+#define MLSHM_VERSION   1
+#define MLSHM_NAME_FMT  "/memleak.%d"   // For shm_open()
+
+struct mlshm_header
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t header_size;     // Offset of the first site
+	uint32_t site_size;       // Bytes per site, its counters included
+	uint32_t max_sites;
+	uint32_t nr_sites;        // Sites in use
+	uint32_t dropped_sites;   // Sites left out when the segment was full
+	uint32_t shards;          // Counter slots per site
+	uint32_t shard_size;      // Bytes per counter slot
+	uint32_t counter_size;    // Bytes per counter, sizeof(long)
+	uint32_t est_one;         // Fixed point one of 'est_blocks'
+	uint32_t off_blocks;      // Offsets of the counters in a slot
+	uint32_t off_bytes;
+	uint32_t off_est_blocks;
+	uint32_t off_est_bytes;
+	uint32_t off_allocs;
+	uint32_t pid;
+	uint64_t start_time;      // Seconds since the epoch when opened
+};
+
+#define MLSHM_SITE_NAME_MAX  248
+
+struct mlshm_site
+{
+	char     name[MLSHM_SITE_NAME_MAX];  // As in reports, NUL terminated
+	uint32_t id;                         // Site id, as in the event stream
+	uint32_t reserved;
+};
+
+#endif  // SS_MEMLEAK_SHM_H
@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2010-2012 Sami Sorell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/***** bench ****************************************************************
+ *
+ * Measures the cost of a malloc/free pair in ns per pair and thread, with
+ * 1, 2, 4..N threads, a number of allocation sites and a size distribution,
+ * in these modes:
+ * - libc     the C library without memleak,
+ * - off      memleak with tracking off,
+ * - on       memleak tracking every allocation,
+ * - sampled  memleak tracking a sample, one per 512 KB allocated,
+ * - verbose  tracking with SS_MEMTRACE_VERBOSE, when built with it.
+ *
+ * Every thread keeps a window of live blocks and replaces the oldest one
+ * on every round. The best of the repeats is taken.
+ *
+ * Results are printed as CSV. Given a baseline in the same format, results
+ * slower than the baseline by more than the tolerance are reported and the
+ * exit status is 1. A baseline that can't be read exits with status 2.
+ *
+ * Usage: bench [-t threads] [-s sites] [-d sizes] [-m modes] [-n rounds]
+ *              [-k repeats] [-b baseline] [-r percent] [-H]
+ *
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../memleak.h"
+
+#undef malloc
+#undef free
+
+
+#define WINDOW        64      // Live blocks per thread
+#define SIZES         4096    // Sizes drawn per run
+#define SAMPLE_PERIOD 524288  // Bytes per sample in 'sampled' mode
+
+#ifdef SS_MEMTRACE_VERBOSE
+# define TRACKED_MODE  "verbose"
+#else
+# define TRACKED_MODE  "on"
+#endif
+
+
+struct bench_run
+{
+	std::string mode;
+	int    threads;
+	int    sites;
+	std::string sizes;
+	long   rounds;
+	bool   libc;
+	std::vector<size_t> size_list;
+	std::vector<struct alloc_record *> site_list;
+	pthread_barrier_t start;
+	long long elapsed;  // Sum of the threads' times in ns
+};
+
+
+// Monotonic time in nanoseconds
+static double
+now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+
+// Small fast generator, the same sequence in every run
+static unsigned long
+next_random(unsigned long long *const state)
+{
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (unsigned long) (*state >> 33);
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does:
+    Draws the block sizes of a run.
+
+  Wants:
+    name - small: 8..256 bytes, mixed: log-uniform 8..16K,
+	       large: 16K..256K.
+	list - Where to store the sizes.
+
+  Gives:
+    False if the name is not known.
+----------------------------------------------------------------------------*/
+
+static bool
+draw_sizes(std::string const &name, std::vector<size_t> &list)
+{
+	unsigned long long state = 1;
+	int i;
+
+	list.resize(SIZES);
+
+	for (i = 0; i < SIZES; ++i) {
+		unsigned long const r = next_random(&state);
+
+		if ("small" == name) {
+			list[i] = 8 + r % 249;
+		}
+		else if ("mixed" == name) {
+			list[i] = (8UL << (r % 11)) + (r >> 8) % (8UL << (r % 11));
+		}
+		else if ("large" == name) {
+			list[i] = 16384 + r % (262144 - 16384);
+		}
+		else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+static void *
+bench_thread(void *const arg)
+{
+	struct bench_run *const run = (struct bench_run *) arg;
+	size_t const nr_sites = run->site_list.size();
+	void *window[WINDOW];
+	unsigned int size_it = (unsigned int) (pthread_self() >> 4);
+	long i;
+
+	memset(window, 0, sizeof(window));
+	pthread_barrier_wait(&run->start);
+
+	// Timed by every thread itself, as the threads may not start together
+	double const start = now_ns();
+
+	for (i = 0; i < run->rounds; ++i) {
+		void **const slot = &window[i % WINDOW];
+		size_t const size = run->size_list[++size_it % SIZES];
+
+		if (run->libc) {
+			free(*slot);
+			*slot = malloc(size);
+		}
+		else {
+			ss_free(*slot);
+			*slot = ss_malloc_at(size, run->site_list[i % nr_sites]);
+		}
+	}
+
+	__atomic_fetch_add(&run->elapsed, (long long) (now_ns() - start), __ATOMIC_RELAXED);
+
+	for (i = 0; i < WINDOW; ++i) {
+		run->libc ? free(window[i]) : ss_free(window[i]);
+	}
+
+	return NULL;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does:
+    Runs the threads of a measurement once.
+
+  Wants:
+    run - The measurement.
+
+  Gives:
+    Average wall clock nanoseconds per malloc/free pair of a thread.
+----------------------------------------------------------------------------*/
+
+static double
+bench_once(struct bench_run &run)
+{
+	std::vector<pthread_t> threads(run.threads);
+	int i;
+
+	run.elapsed = 0;
+	pthread_barrier_init(&run.start, NULL, run.threads);
+
+	for (i = 0; i < run.threads; ++i) {
+		if (pthread_create(&threads[i], NULL, bench_thread, &run)) {
+			perror("pthread_create");
+			exit(2);
+		}
+	}
+
+	for (i = 0; i < run.threads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_barrier_destroy(&run.start);
+
+	return (double) run.elapsed / run.threads / run.rounds;
+}
+
+
+// Sets memleak up for a mode. Gives false if the mode is not known.
+static bool
+set_mode(std::string const &mode, struct bench_run &run)
+{
+	run.libc = false;
+	ss_memleak_sample_period = 0;
+
+	if ("libc" == mode) {
+		run.libc = true;
+		memleak_pause();
+	}
+	else if ("off" == mode) {
+		memleak_pause();
+	}
+	else if (TRACKED_MODE == mode) {
+		memleak_resume();
+	}
+	else if ("sampled" == mode) {
+		ss_memleak_sample_period = SAMPLE_PERIOD;
+		memleak_resume();
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+
+// Splits a comma separated list
+static std::vector<std::string>
+split(char const *const list)
+{
+	std::vector<std::string> items;
+	char const *it = list;
+
+	while (*it) {
+		char const *const comma = strchr(it, ',');
+		size_t const len = comma ? (size_t) (comma - it) : strlen(it);
+
+		items.push_back(std::string(it, len));
+		it += comma ? len + 1 : len;
+	}
+
+	return items;
+}
+
+
+static std::string
+run_key(std::string const &mode, int const threads, int const sites, std::string const &sizes)
+{
+	char key[128];
+
+	snprintf(key, sizeof(key), "%s,%d,%d,%s", mode.c_str(), threads, sites, sizes.c_str());
+	return key;
+}
+
+
+/*---- Function -------------------------------------------------------------
+  Does:
+    Reads results of an earlier run. Lines starting with '#' and the
+	header are skipped.
+
+  Wants:
+    path     - The baseline file.
+	baseline - Where to store ns per pair by run_key().
+
+  Gives:
+    False if the file could not be read or holds no results.
+----------------------------------------------------------------------------*/
+
+static bool
+read_baseline(char const *const path, std::map<std::string, double> &baseline)
+{
+	FILE *const in = fopen(path, "r");
+	char line[256];
+
+	if (!in) {
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		char *const comma = strrchr(line, ',');
+
+		if ('#' == line[0]  ||  !comma  ||  0 == strncmp(line, "mode,", 5)) {
+			continue;
+		}
+
+		*comma = '\0';
+		baseline[line] = strtod(comma + 1, NULL);
+	}
+
+	fclose(in);
+	return !baseline.empty();
+}
+
+
+static void
+usage(char const *const name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -t threads   Highest thread count, run with 1, 2, 4.. (default CPUs)\n"
+		"  -s sites     Numbers of allocation sites (default 1,64,1024)\n"
+		"  -d sizes     Size distributions: small, mixed, large (default small,mixed)\n"
+		"  -m modes     libc, off, " TRACKED_MODE ", sampled (default all)\n"
+		"  -n rounds    malloc/free pairs per thread (default 200000)\n"
+		"  -k repeats   Best of this many runs (default 5)\n"
+		"  -b baseline  Compare to results in this file\n"
+		"  -r percent   Slowdown tolerated against the baseline (default 25)\n"
+		"  -H           Leave the CSV header out\n", name);
+}
+
+
+int main(int const argc, char *const argv[])
+{
+	int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	char const *site_counts = "1,64,1024";
+	char const *distributions = "small,mixed";
+	char const *modes = "libc,off," TRACKED_MODE ",sampled";
+	char const *baseline_path = NULL;
+	long rounds = 200000;
+	int repeats = 5;
+	double tolerance = 25.0;
+	bool header = true;
+	std::map<std::string, double> baseline;
+	struct bench_run run;
+	int regressions = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:d:m:n:k:b:r:Hh")) != -1) {
+		switch (opt) {
+		case 't':  max_threads = atoi(optarg);           break;
+		case 's':  site_counts = optarg;                 break;
+		case 'd':  distributions = optarg;               break;
+		case 'm':  modes = optarg;                       break;
+		case 'n':  rounds = strtol(optarg, NULL, 0);     break;
+		case 'k':  repeats = atoi(optarg);               break;
+		case 'b':  baseline_path = optarg;               break;
+		case 'r':  tolerance = strtod(optarg, NULL);     break;
+		case 'H':  header = false;                       break;
+
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (max_threads < 1  ||  rounds < WINDOW  ||  repeats < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	// Nothing to compare to is a failure, not a pass
+	if (baseline_path  &&  !read_baseline(baseline_path, baseline)) {
+		printf("# No baseline in %s, store one with 'make bench-baseline'\n", baseline_path);
+		return 2;
+	}
+
+	std::vector<std::string> const mode_list = split(modes);
+	std::vector<std::string> const site_list = split(site_counts);
+	std::vector<std::string> const size_list = split(distributions);
+	size_t m, s, d;
+
+	if (header) {
+		printf("mode,threads,sites,sizes,ns_per_op\n");
+	}
+
+	for (m = 0; m < mode_list.size(); ++m) {
+		if (!set_mode(mode_list[m], run)) {
+			fprintf(stderr, "Unknown mode %s\n", mode_list[m].c_str());
+			return 2;
+		}
+
+		for (s = 0; s < site_list.size(); ++s) {
+			int const sites = atoi(site_list[s].c_str());
+
+			// Sites are registered once and reused by the later runs
+			run.site_list.clear();
+
+			for (int line = 1; line <= (sites > 0 ? sites : 1); ++line) {
+				run.site_list.push_back(ss_memleak_point_register("bench.cpp", line));
+			}
+
+			for (d = 0; d < size_list.size(); ++d) {
+				if (!draw_sizes(size_list[d], run.size_list)) {
+					fprintf(stderr, "Unknown sizes %s\n", size_list[d].c_str());
+					return 2;
+				}
+
+				for (int threads = 1; threads <= max_threads; threads = threads < max_threads  &&  threads * 2 > max_threads ? max_threads : threads * 2) {
+					double best = 0.0;
+
+					run.mode    = mode_list[m];
+					run.threads = threads;
+					run.sites   = (int) run.site_list.size();
+					run.sizes   = size_list[d];
+					run.rounds  = rounds;
+
+					for (int k = 0; k < repeats; ++k) {
+						double const ns = bench_once(run);
+
+						if (0 == k  ||  ns < best) {
+							best = ns;
+						}
+					}
+
+					std::string const key = run_key(run.mode, threads, run.sites, run.sizes);
+					std::map<std::string, double>::const_iterator const base = baseline.find(key);
+
+					printf("%s,%.1f\n", key.c_str(), best);
+					fflush(stdout);
+
+					if (base != baseline.end()  &&  best > base->second * (1.0 + tolerance / 100.0)) {
+						printf("# REGRESSION %s: %.1f ns, baseline %.1f ns\n", key.c_str(), best, base->second);
+						++regressions;
+					}
+				}
+			}
+		}
+	}
+
+	memleak_pause();
+
+	return regressions ? 1 : 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Runs real binaries under the preload library, with and without call 
+# stacks, and fails if one exits differently than without it. Frame 
+# pointer chains of binaries built without them hold garbage, which the
+# stack walker must survive.
+#
+# Usage: preload-test.sh [path/to/libmemleak-preload.so]
+
+LIB=$(cd "$(dirname "${1:-../libmemleak-preload.so}")" && pwd)/$(basename "${1:-../libmemleak-preload.so}")
+FAILED=0
+
+run()
+{
+	sh -c "$1" >/dev/null 2>&1
+	expected=$?
+
+	for depth in 0 4 16; do
+		MEMLEAK_STACK_DEPTH=$depth LD_PRELOAD=$LIB sh -c "$1" >/dev/null 2>&1
+		status=$?
+
+		if [ $status -ne $expected ]; then
+			echo "FAIL: MEMLEAK_STACK_DEPTH=$depth $1: exit $status, expected $expected"
+			FAILED=1
+		fi
+	done
+}
+
+if [ ! -f "$LIB" ]; then
+	echo "No $LIB, run 'make preload' first"
+	exit 2
+fi
+
+run "ls -l /"
+run "sort /etc/passwd"
+run "bash -c 'x=\$(ls /); [[ \$x =~ [a-z]+ ]] && echo \$x'"
+
+if command -v python3 >/dev/null; then
+	run "python3 -c 'import re; print(sorted(re.findall(\"[a-z]+\", \"b a c\")))'"
+fi
+
+[ $FAILED -eq 0 ] && echo "preload test passed"
+exit $FAILED
@@ -1,12 +1,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <list>
 #include <sys/time.h>
 #include <pthread.h>
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "../memleak.h"
 
@@ -153,6 +156,266 @@ signal_handler(int sig)
 }
 
 
+/****************************************************************************
+   BEHAVIOUR CHECKS, run with: LD_LIBRARY_PATH=.. ./test checks
+*****************************************************************************/
+
+static int failures;
+
+#define CHECK(cond, fmt, args...)  \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: " fmt "\n", __FUNCTION__, __LINE__, ## args); \
+		++failures; \
+	}
+
+
+// Counters of the site of this file at a line, in an epoch or in none
+struct site_query
+{
+	int         line;
+	char const  *epoch;
+	long        blocks;
+	size_t      bytes;
+	long        overruns;
+};
+
+static void
+site_find(struct memleak_site const *site, void *arg)
+{
+	struct site_query *const query = (struct site_query *) arg;
+	size_t const len = site->file ? strlen(site->file) : 0;
+	
+	if (len < 8  ||  strcmp(site->file + len - 8, "test.cpp")  ||  site->line != query->line) {
+		return;
+	}
+	
+	if (site->epoch != query->epoch  &&  (!site->epoch  ||  !query->epoch  ||  strcmp(site->epoch, query->epoch))) {
+		return;
+	}
+	
+	query->blocks   += site->blocks;
+	query->bytes    += site->bytes;
+	query->overruns += site->overruns;
+}
+
+static struct site_query
+site_at(int line, char const *epoch = NULL)
+{
+	struct site_query query = { line, epoch, 0, 0, 0 };
+	
+	memleak_sites(site_find, &query);
+	
+	return query;
+}
+
+
+static void
+check_realloc(void)
+{
+	int const line = __LINE__ + 1;
+	unsigned char *p = (unsigned char *) malloc(64);
+	unsigned char *q;
+	int i;
+	
+	for (i = 0; i < 64; ++i) {
+		p[i] = (unsigned char) i;
+	}
+	
+	// There is room for one more byte in the block, it must not move
+	q = (unsigned char *) realloc(p, 65);
+	CHECK(q == p, "realloc(65) moved the block from %p to %p", (void *) p, (void *) q);
+	CHECK(65 == site_at(line).bytes, "site has %lu bytes after growing in place", (unsigned long) site_at(line).bytes);
+	
+	// Far bigger, the block may move but keeps its contents
+	p = (unsigned char *) realloc(q, 1 << 20);
+	
+	for (i = 0; i < 64  &&  p[i] == i; ++i) {
+	}
+	
+	CHECK(64 == i, "byte %d lost in realloc", i);
+	CHECK(1 == site_at(line).blocks  &&  (size_t) 1 << 20 == site_at(line).bytes, "site has %ld blocks, %lu bytes", 
+		site_at(line).blocks, (unsigned long) site_at(line).bytes);
+	
+	free(p);
+	CHECK(0 == site_at(line).blocks, "site has %ld blocks after free", site_at(line).blocks);
+}
+
+
+struct alignas(128) Aligned
+{
+	char c;
+};
+
+static void
+check_alignment(void)
+{
+	size_t const aligns[] = { 16, 64, 256, 4096 };
+	size_t i;
+	
+	for (i = 0; i < sizeof(aligns) / sizeof(aligns[0]); ++i) {
+		void *p = NULL;
+		void *const q = aligned_alloc(aligns[i], 3 * aligns[i]);
+		int const err = posix_memalign(&p, aligns[i], 100);
+		
+		CHECK(0 == err  &&  0 == (uintptr_t) p % aligns[i], "posix_memalign(%lu) gave %p, %d", 
+			(unsigned long) aligns[i], p, err);
+		CHECK(q  &&  0 == (uintptr_t) q % aligns[i], "aligned_alloc(%lu) gave %p", (unsigned long) aligns[i], q);
+		
+		free(p);
+		free(q);
+	}
+	
+	void *p = NULL;
+	
+	CHECK(EINVAL == posix_memalign(&p, 0, 8), "posix_memalign(0) accepted");
+	CHECK(EINVAL == posix_memalign(&p, 24, 8), "posix_memalign(24) accepted");
+	
+	Aligned *const a = new Aligned;
+	Aligned *const b = new Aligned[3];
+	
+	CHECK(0 == (uintptr_t) a % 128  &&  0 == (uintptr_t) b % 128, "new of alignas(128) gave %p, %p", (void *) a, (void *) b);
+	
+	delete a;
+	delete [] b;
+}
+
+
+// Allocates at a line of its own, for a guard rule set before the first call
+static char *
+canary_alloc(size_t size, int *line)
+{
+	*line = __LINE__;  return (char *) malloc(size);
+}
+
+static char *
+page_alloc(size_t size, int *line)
+{
+	*line = __LINE__;  return (char *) malloc(size);
+}
+
+
+static void
+check_guards(void)
+{
+	volatile size_t const size = 16;
+	int line;
+	
+	// Learn the line, then guard it
+	free(canary_alloc(1, &line));
+	memleak_guard("test.cpp", line, MEML_GUARD_CANARY);
+	
+	char *p = canary_alloc(size, &line);
+	
+	p[size - 1] = 1;
+	free(p);
+	CHECK(0 == site_at(line).overruns, "overrun found in a block written within");
+	
+	p = canary_alloc(size, &line);
+	p[size] = 1;
+	free(p);
+	CHECK(1 == site_at(line).overruns, "%ld overruns after writing past a canary block", site_at(line).overruns);
+	
+	// Writing past a page guarded block faults
+	pid_t const pid = fork();
+	int status = 0;
+	
+	if (0 == pid) {
+		signal(SIGSEGV, SIG_DFL);
+		signal(SIGBUS, SIG_DFL);
+		free(page_alloc(1, &line));
+		memleak_guard("test.cpp", line, MEML_GUARD_PAGE);
+		
+		char *const q = page_alloc(size, &line);
+		
+		q[size - 1] = 1;
+		q[size] = 1;
+		_exit(0);
+	}
+	
+	waitpid(pid, &status, 0);
+	CHECK(WIFSIGNALED(status)  &&  (SIGSEGV == WTERMSIG(status)  ||  SIGBUS == WTERMSIG(status)), 
+		"writing past a page guarded block gave status %#x", status);
+}
+
+
+static void
+check_regions(void)
+{
+	struct alloc_epoch *const epoch = memleak_epoch("checks");
+	struct alloc_epoch *prev;
+	char *in[2];
+	char *out;
+	char *again;
+	int line, out_line, again_line;
+	int i;
+	
+	memleak_pause();
+	
+	for (i = 0; i < 2; ++i) {
+		prev = memleak_region_begin(i ? epoch : NULL);
+		line = __LINE__;  in[i] = (char *) malloc(10);
+		memleak_region_end(prev);
+	}
+	
+	out_line = __LINE__;  out = (char *) malloc(10);
+	
+	CHECK(1 == site_at(line).blocks, "%ld blocks in no epoch", site_at(line).blocks);
+	CHECK(1 == site_at(line, "checks").blocks, "%ld blocks in epoch", site_at(line, "checks").blocks);
+	CHECK(0 == site_at(out_line).blocks, "%ld blocks outside a region", site_at(out_line).blocks);
+	
+	// An unpaired end must not turn off the next region
+	memleak_region_end(NULL);
+	prev = memleak_region_begin(epoch);
+	again_line = __LINE__;  again = (char *) malloc(10);
+	memleak_region_end(prev);
+	
+	CHECK(1 == site_at(again_line, "checks").blocks, "region after an unpaired end not tracked");
+	
+	memleak_resume();
+	
+	free(in[0]);
+	free(in[1]);
+	free(out);
+	free(again);
+}
+
+
+static void
+check_pauses(void)
+{
+	char *paused, *resumed;
+	int paused_line, resumed_line;
+	
+	// An unpaired resume must not cancel the next pause
+	memleak_thread_resume();
+	memleak_thread_pause();
+	paused_line = __LINE__;  paused = (char *) malloc(10);
+	memleak_thread_resume();
+	resumed_line = __LINE__;  resumed = (char *) malloc(10);
+	
+	CHECK(0 == site_at(paused_line).blocks, "%ld blocks tracked while paused", site_at(paused_line).blocks);
+	CHECK(1 == site_at(resumed_line).blocks, "%ld blocks tracked after resume", site_at(resumed_line).blocks);
+	
+	free(paused);
+	free(resumed);
+}
+
+
+static int
+run_checks(void)
+{
+	check_realloc();
+	check_alignment();
+	check_guards();
+	check_regions();
+	check_pauses();
+	
+	fprintf(stderr, "%s\n", failures ? "Checks failed" : "Checks passed");
+	
+	return failures ? 1 : 0;
+}
+
+
 int main(int const argc, char *const argv[])
 {
 	//
@@ -162,6 +425,7 @@ int main(int const argc, char *const argv[])
 
 	bool runBasicTest = false;
 	bool runStressTest = false;
+	bool runChecks = false;
 
 	if (argc < 2) {
 		// This is default when no arguments are given
@@ -175,6 +439,9 @@ int main(int const argc, char *const argv[])
 			else if (!strcmp(argv[i], "basic")) {
 				runBasicTest = true;
 			}
+			else if (!strcmp(argv[i], "checks")) {
+				runChecks = true;
+			}
 		}
 	}
 
@@ -210,6 +477,10 @@ int main(int const argc, char *const argv[])
 		// memleak_report();
 	}
 	
+	if (runChecks  &&  run_checks()) {
+		return 1;
+	}
+	
 	if (runStressTest) {
 		signal(SIGINT, signal_handler);
 		stress_test();
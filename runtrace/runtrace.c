@@ -30,8 +30,12 @@
  #endif
 
  #include <linux/kernel.h>
+ #include <linux/ctype.h>
  #include <linux/slab.h>
  #include <linux/time.h>
+ #include <linux/timekeeping.h>
+ #include <linux/timex.h>
+ #include <linux/delay.h>
  #include <linux/sched.h>
  #include <linux/fs.h>
  #include <linux/cdev.h>
@@ -40,12 +44,18 @@
 #else
  #include <stdio.h>
  #include <stdlib.h>
+ #include <stddef.h>
  #include <string.h>
  #include <stdarg.h>
  #include <unistd.h>
  #include <sys/time.h>
+ #include <time.h>
  #include <signal.h>
  #include <pthread.h>
+
+ #if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+ #endif
  
  #ifdef __GXX_EXPERIMENTAL_CXX0X__
   #include <atomic>
@@ -72,6 +82,12 @@
  #define FREE(x)                 kfree(x)
  #define GETTIMEOFDAY(x)         do_gettimeofday(x)
  // #define NR_CPUS  This is defined in kernel headers
+
+ #define CLOCK_TSC()             ((u64) get_cycles())
+ #define CLOCK_RAW()             ((u64) ktime_get_raw_ns())
+ #define CLOCK_COARSE()          ((u64) ktime_get_coarse_ns())
+ #define CLOCK_WALL()            ((u64) ktime_get_real_ns())
+ #define SLEEP_MS(x)             msleep(x)
  
  #define LOCK_DECLARE(x)         DEFINE_RWLOCK(x)
  #define LOCK_INIT(x)            do {} while(0);
@@ -91,6 +107,13 @@
  #define ATOMIC_TEST_AND_SET(x)  test_and_set_bit(0, &x)
  #define ATOMIC_CLEAR(x)         clear_bit(0, &x)
 
+ #define LOAD_ACQUIRE(x)         smp_load_acquire(&x)
+ #define STORE_RELEASE(x, n)     smp_store_release(&x, n)
+ #define CMPXCHG(x, old, n)      ((old) == cmpxchg(&x, old, n))
+ #define READ_FENCE()            smp_rmb()
+ #define WRITE_FENCE()           smp_wmb()
+ #define CPU_RELAX()             cpu_relax()
+
 #else  // ! __KERNEL__
 
  #define MALLOC(x)               malloc(x)
@@ -99,6 +122,16 @@
  #define NR_CPUS                 sysconf(_SC_NPROCESSORS_ONLN)
  #define u64                     unsigned long long
 
+ #if defined(__x86_64__) || defined(__i386__)
+  #define CLOCK_TSC()             ((u64) __rdtsc())
+ #else
+  #define CLOCK_TSC()             0ULL  // No TSC, runtrace_clock() falls back to RT_CLOCK_RAW
+ #endif
+ #define CLOCK_RAW()             clock_ns(CLOCK_MONOTONIC_RAW)
+ #define CLOCK_COARSE()          clock_ns(CLOCK_MONOTONIC_COARSE)
+ #define CLOCK_WALL()            clock_ns(CLOCK_REALTIME)
+ #define SLEEP_MS(x)             usleep((x) * 1000)
+
  #define LOCK_DECLARE(x)         pthread_rwlock_t x;
  #define LOCK_INIT(x)            { pthread_rwlockattr_t x##_attr; \
                                  pthread_rwlockattr_init(&x##_attr); \
@@ -131,9 +164,28 @@
   #define ATOMIC_CLEAR(x)         __sync_fetch_and_and(&x, ~1)
  #endif
 
+ #define LOAD_ACQUIRE(x)         __atomic_load_n(&x, __ATOMIC_ACQUIRE)
+ #define STORE_RELEASE(x, n)     __atomic_store_n(&x, n, __ATOMIC_RELEASE)
+ #define CMPXCHG(x, old, n)      __sync_bool_compare_and_swap(&x, old, n)
+ #define READ_FENCE()            __atomic_thread_fence(__ATOMIC_ACQUIRE)
+ #define WRITE_FENCE()           __atomic_thread_fence(__ATOMIC_RELEASE)
+ #define CPU_RELAX()             sched_yield()
+
 #endif  // ! __KERNEL__
 
 
+#ifndef __KERNEL__
+static inline u64
+clock_ns(clockid_t const id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+
 
 static LOCK_DECLARE(print_rwlock);
 static int lock_initialised;
@@ -144,14 +196,23 @@ static int lock_initialised;
  *
  * Contains data of one tracept created by make_tracept().
  *
+ * seq
+ *   (RT_LAYOUT_SHARED) Sequence number of the slot: 2n+1 while tracept n is 
+ *   being written to it, 2n+2 when it is complete. Readers check it before
+ *   and after copying the slot, instead of stopping the writers.
+ *   (RT_LAYOUT_LOCAL) Bytes of the record in the ring, see struct tp_ring.
  * time
- *   Timestamp of when the tracept is created
+ *   Timestamp of when the tracept is created, in ticks of the clock source.
+ *   See clock_ticks().
  * line
  *   Line number from where tracept is created
  * src
  *   Ptr to nul-terminated string that is available for the whole life time of
  *   tracept facility.
  *   See make_tracept() for detailed info.
+ * format
+ *   Format of a binary tracept (TP_FILE_B, TP_FUNK_B), NULL for text. Then
+ *   msg holds the raw arguments, see format_args().
  * msg
  *   Free text field for user input data.
  *
@@ -159,18 +220,106 @@ static int lock_initialised;
 
 struct tracept
 {
-	struct timeval time;
-	
+	unsigned int seq;
 	int  line;
+	u64 time;
+	
 	char const *src;
+	struct rt_format const *format;
 
 	char msg[RT_MSG_MAX];
 };
 
+// Bytes of a tracept record with msg_len bytes of message, and the largest
+#define RECORD_SIZE(msg_len)  ((offsetof(struct tracept, msg) + (msg_len) + 7) & ~7)
+#define RECORD_MAX            RECORD_SIZE(RT_MSG_MAX)
+
+
+static inline int
+tp_before(struct tracept const *const a, struct tracept const *const b)
+{
+	return a->time < b->time;
+}
+
 
 static struct tracept *tp_pool;
 static struct tracept *tp_pool_copy;
 static ATOMIC_VAR(next_tp);
+static unsigned int pool_copied;  // Slots before this are in tp_pool_copy
+
+
+/**
+ * Private struct tp_ring
+ *
+ * With RT_LAYOUT_LOCAL every thread (userspace) or CPU (kernel) writes its
+ * tracepts in a ring of its own. A ring has a single writer at a time, so 
+ * it is written without atomic operations or locks: the writer fills the 
+ * entry and then publishes it by advancing head. Nothing is shared between
+ * the writers, so the cost of a tracept stays the same with more cores.
+ *
+ * The ring is ring_size bytes of variable length records: a struct tracept
+ * cut after its message, 8 byte aligned, its seq telling the record's size.
+ * A record never wraps; where less than RECORD_MAX bytes are left before
+ * the end of the ring, the next record starts from the beginning, see 
+ * record_next(). Before writing, the writer moves tail past the oldest 
+ * records until RECORD_MAX bytes are free after head.
+ *
+ * Readers copy a ring without stopping its writer. After the copy, tail is
+ * read again; records before it may have been overwritten meanwhile and 
+ * are dropped. print_trace_stack() merges the copies of all rings by 
+ * timestamp.
+ *
+ * In userspace a thread takes a free ring on its first tracept and gives
+ * it back when it exits, history included. There are as many rings as the
+ * nr_of_threads param; tracepts of threads beyond that are lost and counted.
+ * In the kernel a CPU writes its ring with interrupts disabled.
+ *
+ * head, tail
+ *   Byte positions of the next record and the oldest one. Advanced by the 
+ *   writer only; they wrap around at 2^32.
+ * printed
+ *   Next record to print when printing incrementally (priv != NULL).
+ * copied
+ *   Bytes before this are in copy, only the later ones are copied.
+ * start, end
+ *   Range of valid records in copy, set by the reader.
+ * in_use
+ *   (USERSPACE) Bit 0 denotes if a thread owns the ring.
+ * tps, copy
+ *   The ring's records and the reader's copy of them.
+ *
+*/
+
+struct tp_ring
+{
+	unsigned int head;
+	unsigned int tail;
+	unsigned int printed;
+	unsigned int copied;
+	unsigned int start;
+	unsigned int end;
+#ifndef __KERNEL__
+	ATOMIC_FLAG(in_use);
+#endif
+	char *tps;
+	char *copy;
+};
+
+static struct tp_ring *tp_rings;
+static char *tp_ring_mem;
+static unsigned int ring_size;  // Bytes per ring, power of 2
+static unsigned int ring_mask;
+static int nr_rings;
+static int tp_layout = RT_LAYOUT_SHARED;
+static ATOMIC_FLAG(reader_busy);  // Readers share the copies, so they take turns
+
+#ifndef __KERNEL__
+static __thread struct tp_ring *thread_ring;
+static __thread int thread_ring_generation;
+static int ring_generation = 1;
+static pthread_key_t ring_key;
+static ATOMIC_VAR(ring_lost_tps);
+#endif
 
 
 /**
@@ -271,6 +420,106 @@ static int cdev_blocking_read = 1;
 
 
 
+/**
+ * Private clock globals
+ *
+ * Tracepts are stamped with the raw ticks of the selected clock source and 
+ * converted to wall time only when printed:
+ *   ns = clock_wall0 + (ticks - clock_ticks0) * clock_mult / 2^32
+ *
+ * tp_clock
+ *   RT_CLOCK_* source, see runtrace.h
+ * clock_ticks0, clock_wall0
+ *   Ticks of the source and wall time in ns, read together by clock_calibrate()
+ * clock_mult
+ *   Nanoseconds per tick, fixed point with 32 fraction bits
+ *
+*/
+
+static int tp_clock = RT_CLOCK_RAW;
+static u64 clock_ticks0;
+static u64 clock_wall0;
+static u64 clock_mult = 1ULL << 32;
+
+
+static inline u64
+clock_ticks(void)
+{
+	switch (tp_clock) {
+	case RT_CLOCK_TSC:     return CLOCK_TSC();
+	case RT_CLOCK_COARSE:  return CLOCK_COARSE();
+	default:               return CLOCK_RAW();
+	}
+}
+
+
+/**
+ * Private function clock_to_ns()
+ *
+ * ticks
+ *   Timestamp of a tracept
+ *
+ * Return
+ *   Wall time of the timestamp in ns since the epoch.
+ *
+*/
+
+static u64
+clock_to_ns(u64 const ticks)
+{
+	// The CPUs' TSCs may be a bit apart, so a timestamp can be before ticks0
+	int const before = ticks < clock_ticks0;
+	u64 const delta = before ? clock_ticks0 - ticks : ticks - clock_ticks0;
+	u64 const lo = delta & 0xffffffff;
+	u64 const ns = (delta >> 32) * clock_mult + lo * (clock_mult >> 32) + 
+		((lo * (clock_mult & 0xffffffff)) >> 32);
+
+	return before ? clock_wall0 - ns : clock_wall0 + ns;
+}
+
+
+/**
+ * Private function clock_calibrate()
+ *
+ * Reads the start point of the clock source against wall time. For
+ * RT_CLOCK_TSC the tick rate is measured against CLOCK_MONOTONIC_RAW over 
+ * 10 ms first. If there is no usable TSC, the source is changed to 
+ * RT_CLOCK_RAW.
+ *
+ * Return
+ *   void
+ *
+*/
+
+static void
+clock_calibrate(void)
+{
+	clock_mult = 1ULL << 32;
+
+	if (RT_CLOCK_TSC == tp_clock) {
+		u64 const ns0 = CLOCK_RAW();
+		u64 const tsc0 = CLOCK_TSC();
+		u64 ns1, tsc1;
+
+		SLEEP_MS(10);
+
+		ns1 = CLOCK_RAW();
+		tsc1 = CLOCK_TSC();
+
+		if (tsc1 > tsc0  &&  ns1 > ns0) {
+			clock_mult = ((ns1 - ns0) << 32) / (tsc1 - tsc0);
+		}
+		else {
+			RT_WARNING("No usable TSC, using RT_CLOCK_RAW\n");
+			tp_clock = RT_CLOCK_RAW;
+		}
+	}
+
+	clock_ticks0 = clock_ticks();
+	clock_wall0 = CLOCK_WALL();
+}
+
+
 static void
 print_vsbp_underrun_notice(void)
 {
@@ -280,6 +529,17 @@ print_vsbp_underrun_notice(void)
 	RT_WARNING("************************************************************\n");
 }
 
+#ifndef __KERNEL__
+static void
+print_ring_underrun_notice(void)
+{
+	RT_WARNING("************************************************************\n");
+	RT_WARNING("More threads than rings, %u tracepoints were lost.\n", (unsigned int) ATOMIC_READ(ring_lost_tps));
+	RT_WARNING("You might want to configure higher nr_of_threads. (%d)\n", max_threads);
+	RT_WARNING("************************************************************\n");
+}
+#endif
+
 /**
  * Private function sigabrt()
  *
@@ -310,11 +570,375 @@ sigabort(int const sig)
 	if (vspb_underrun_notice) {
 		print_vsbp_underrun_notice();
 	}
+
+	if (ATOMIC_READ(ring_lost_tps)) {
+		print_ring_underrun_notice();
+	}
 }
 
 #endif  // ! __KERNEL__
 
 
+/**
+ * Binary tracepts
+ *
+ * A TP_FILE_B call site has a static struct rt_format of its own. On the
+ * first call its format string is parsed to the classes of its arguments.
+ * Then every call copies the raw arguments to the tracept, which is as 
+ * cheap as a copy of a short message; the format is applied when printing.
+ * Fixed size arguments come first in their order, strings after them. 
+ * A string is copied up to its '*' precision, which needs no nul.
+ * A format that can't be parsed (%n, wide strings, literal precisions of 
+ * strings, floats and %p extensions in the kernel, too many or too large 
+ * arguments) is printed with vsnprintf as in tpprintf().
+ *
+*/
+
+enum rt_arg_class
+{
+	RT_ARG_INT,
+	RT_ARG_LONG,
+	RT_ARG_LLONG,
+	RT_ARG_PTR,
+	RT_ARG_DOUBLE,
+	RT_ARG_LDOUBLE,
+	RT_ARG_STR,
+	RT_ARG_PREC   // '*' precision of a string
+};
+
+static int const rt_arg_size[] = {
+	sizeof(int), sizeof(long), sizeof(long long), sizeof(void *), 
+#ifdef __KERNEL__
+	0, 0, 
+#else
+	sizeof(double), sizeof(long double), 
+#endif
+	0, sizeof(int)
+};
+
+
+/**
+ * Private function format_spec()
+ * Parses one conversion specification of a format string.
+ *
+ * it
+ *   Ptr to the char after '%'
+ * format
+ *   The classes of the arguments of the spec, '*' width and precision
+ *   included, are added to format->args.
+ *
+ * Return
+ *   Ptr to the char after the spec, or NULL if it is not supported.
+ *
+*/
+
+static char const *
+format_spec(char const *it, struct rt_format *const format)
+{
+	int length = 0;  // 'h' -1, 'l' 1, 'll' 2, 'L' 3
+	int precision = -1;  // Index of the '*' precision arg, -2 for a literal one
+	int arg;
+
+	while ('-' == *it  ||  '+' == *it  ||  ' ' == *it  ||  '#' == *it  ||  '0' == *it  ||  '\'' == *it) {
+		++it;
+	}
+
+	for (arg = 0; arg < 2; ++arg) {
+		if ('*' == *it) {
+			if (format->nr_args >= RT_FMT_ARGS_MAX) {
+				return NULL;
+			}
+			if (arg) {
+				precision = format->nr_args;
+			}
+			format->args[format->nr_args++] = RT_ARG_INT;
+			++it;
+		}
+		else {
+			if (arg) {
+				precision = -2;
+			}
+			while ('0' <= *it  &&  *it <= '9') {
+				++it;
+			}
+		}
+
+		if ('.' != *it  ||  arg) {
+			break;
+		}
+		++it;
+	}
+
+	switch (*it) {
+	case 'h':  length = -1;  it += 'h' == it[1] ? 2 : 1;  break;
+	case 'l':  length = 'l' == it[1] ? 2 : 1;  it += length;  break;
+	case 'q':
+	case 'j':  length = 2;  ++it;  break;
+	case 'z':
+	case 't':  length = 1;  ++it;  break;
+	case 'L':  length = 3;  ++it;  break;
+	}
+
+	switch (*it) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+		arg = length <= 0 ? RT_ARG_INT : 1 == length ? RT_ARG_LONG : RT_ARG_LLONG;
+		if ('c' == *it  &&  length > 0) {
+			return NULL;
+		}
+		break;
+
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		arg = 3 == length ? RT_ARG_LDOUBLE : RT_ARG_DOUBLE;
+		if (!rt_arg_size[arg]) {
+			return NULL;
+		}
+		break;
+
+	case 'p':
+		arg = RT_ARG_PTR;
+#ifdef __KERNEL__
+		// %pS, %pI4, %ph... print what the pointer points to
+		if (isalnum(it[1])) {
+			return NULL;
+		}
+#endif
+		break;
+
+	case 's':
+		arg = RT_ARG_STR;
+		// The string may lack a nul within a literal precision
+		if (length  ||  -2 == precision) {
+			return NULL;
+		}
+		if (precision >= 0) {
+			format->args[precision] = RT_ARG_PREC;
+		}
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (format->nr_args >= RT_FMT_ARGS_MAX) {
+		return NULL;
+	}
+	format->args[format->nr_args++] = arg;
+
+	return it + 1;
+}
+
+
+/**
+ * Private function format_parse()
+ * Parses the format string of a binary tracept call site on its first use.
+ * The first thread to claim the format parses it into a local copy and
+ * publishes the result at once; the others format their tracepts at once
+ * until then.
+ *
+ * format
+ *   The call site's format. Its state tells the result, see runtrace.h.
+ *
+ * Return
+ *   void
+ *
+*/
+
+static void
+format_parse(struct rt_format *const format)
+{
+	struct rt_format parsed;
+	char const *it = format->fmt;
+	int i;
+
+	if (!CMPXCHG(format->state, 0, 2)) {
+		return;
+	}
+
+	memset(&parsed, 0, sizeof(parsed));
+
+	while (it  &&  (it = strchr(it, '%'))) {
+		if ('%' == *++it) {
+			++it;
+		}
+		else if (!(it = format_spec(it, &parsed))) {
+			STORE_RELEASE(format->state, -1);
+			return;
+		}
+	}
+
+	for (i = 0; i < parsed.nr_args; ++i) {
+		parsed.size += rt_arg_size[parsed.args[i]];
+		parsed.strings += RT_ARG_STR == parsed.args[i];
+	}
+
+	format->nr_args = parsed.nr_args;
+	format->size = parsed.size;
+	format->strings = parsed.strings;
+	memcpy(format->args, parsed.args, sizeof(format->args));
+
+	// Every string needs at least its nul
+	STORE_RELEASE(format->state, parsed.size + parsed.strings <= RT_MSG_MAX ? 1 : -1);
+}
+
+
+/**
+ * Private function format_args()
+ * Copies the arguments of a binary tracept.
+ *
+ * dst
+ *   The tracept's msg
+ * format
+ *   The parsed format of the call site
+ * args
+ *   The arguments
+ *
+ * Return
+ *   Bytes of dst used.
+ *
+*/
+
+static inline int
+format_args(char *const dst, struct rt_format const *const format, va_list *const args)
+{
+	int fixed = 0;
+	int string = format->size;
+	int strings_left = format->strings;
+	int precision = -1;
+	int i;
+
+	for (i = 0; i < format->nr_args; ++i) {
+		switch (format->args[i]) {
+		case RT_ARG_INT:  { int const v = va_arg(*args, int);  memcpy(dst + fixed, &v, sizeof(v));  break; }
+		case RT_ARG_PREC:  { precision = va_arg(*args, int);  memcpy(dst + fixed, &precision, sizeof(precision));  break; }
+		case RT_ARG_LONG:  { long const v = va_arg(*args, long);  memcpy(dst + fixed, &v, sizeof(v));  break; }
+		case RT_ARG_LLONG:  { long long const v = va_arg(*args, long long);  memcpy(dst + fixed, &v, sizeof(v));  break; }
+		case RT_ARG_PTR:  { void *const v = va_arg(*args, void *);  memcpy(dst + fixed, &v, sizeof(v));  break; }
+#ifndef __KERNEL__
+		case RT_ARG_DOUBLE:  { double const v = va_arg(*args, double);  memcpy(dst + fixed, &v, sizeof(v));  break; }
+		case RT_ARG_LDOUBLE:  { long double const v = va_arg(*args, long double);  memcpy(dst + fixed, &v, sizeof(v));  break; }
+#endif
+		case RT_ARG_STR: {
+			char const *str = va_arg(*args, char const *);
+			// Leave room for the nuls of the strings after this one
+			int room = RT_MSG_MAX - string - --strings_left - 1;
+			int len = 0;
+
+			if (!str) {
+				str = "(null)";
+			}
+			// Not a byte past the precision is read
+			if (precision >= 0  &&  precision < room) {
+				room = precision;
+			}
+			while (len < room  &&  str[len]) {
+				++len;
+			}
+
+			memcpy(dst + string, str, len);
+			dst[string + len] = '\0';
+			string += len + 1;
+			precision = -1;
+			break;
+		}
+		}
+
+		fixed += rt_arg_size[format->args[i]];
+	}
+
+	return string;
+}
+
+
+/**
+ * Private function format_print()
+ * Prints a binary tracept's message with its format.
+ *
+ * dst
+ *   Buffer of RT_MSG_MAX bytes
+ * tp
+ *   The tracept
+ *
+ * Return
+ *   void
+ *
+*/
+
+static void
+format_print(char *const dst, struct tracept const *const tp)
+{
+	struct rt_format spec_args;
+	char spec[32];
+	char const *it = tp->format->fmt;
+	char const *const msg = tp->msg;
+	int fixed = 0;
+	int string = tp->format->size;
+	int printed = 0;
+	int stars[2];
+	int nr_stars;
+	int n = 0;
+	int arg = 0;
+
+	while (*it  &&  printed < RT_MSG_MAX - 1) {
+		char const *const spec_start = it;
+		char const *spec_end;
+
+		if ('%' != *it  ||  '%' == it[1]) {
+			dst[printed++] = *it;
+			it += '%' == *it ? 2 : 1;
+			continue;
+		}
+
+		spec_args.nr_args = 0;
+		spec_end = format_spec(it + 1, &spec_args);
+
+		if (!spec_end  ||  spec_end - spec_start >= (int) sizeof(spec)  ||  arg + spec_args.nr_args > tp->format->nr_args) {
+			break;
+		}
+
+		memcpy(spec, spec_start, spec_end - spec_start);
+		spec[spec_end - spec_start] = '\0';
+		it = spec_end;
+
+		for (nr_stars = 0; nr_stars < spec_args.nr_args - 1; ++nr_stars) {
+			memcpy(&stars[nr_stars], msg + fixed, sizeof(int));
+			fixed += sizeof(int);
+			++arg;
+		}
+
+#define FORMAT_PRINT(v)  \
+	n = 0 == nr_stars ? snprintf(dst + printed, RT_MSG_MAX - printed, spec, v) : \
+	    1 == nr_stars ? snprintf(dst + printed, RT_MSG_MAX - printed, spec, stars[0], v) : \
+	    snprintf(dst + printed, RT_MSG_MAX - printed, spec, stars[0], stars[1], v)
+
+		switch (tp->format->args[arg]) {
+		case RT_ARG_INT:  { int v;  memcpy(&v, msg + fixed, sizeof(v));  FORMAT_PRINT(v);  break; }
+		case RT_ARG_LONG:  { long v;  memcpy(&v, msg + fixed, sizeof(v));  FORMAT_PRINT(v);  break; }
+		case RT_ARG_LLONG:  { long long v;  memcpy(&v, msg + fixed, sizeof(v));  FORMAT_PRINT(v);  break; }
+		case RT_ARG_PTR:  { void *v;  memcpy(&v, msg + fixed, sizeof(v));  FORMAT_PRINT(v);  break; }
+#ifndef __KERNEL__
+		case RT_ARG_DOUBLE:  { double v;  memcpy(&v, msg + fixed, sizeof(v));  FORMAT_PRINT(v);  break; }
+		case RT_ARG_LDOUBLE:  { long double v;  memcpy(&v, msg + fixed, sizeof(v));  FORMAT_PRINT(v);  break; }
+#endif
+		case RT_ARG_STR:
+			FORMAT_PRINT(msg + string);
+			string += strlen(msg + string) + 1;
+			break;
+		}
+
+#undef FORMAT_PRINT
+
+		fixed += rt_arg_size[tp->format->args[arg]];
+		++arg;
+
+		if (n > 0) {
+			printed += n < RT_MSG_MAX - printed ? n : RT_MSG_MAX - printed - 1;
+		}
+	}
+
+	dst[printed] = '\0';
+}
+
+
 /**
  * Private function __print_trace_point()
  * Prints out one tracept.
@@ -361,6 +985,7 @@ __print_trace_point(int const flags, char *const dst, struct tracept const *cons
 	int const print_line = flags & RT_PRINT_LINE;
 	int const print_funk = flags & RT_PRINT_SRC;
 	int const print_ms   = flags & RT_PRINT_TIME_MS;
+	int const print_ns   = flags & RT_PRINT_TIME_NS;
 
 #ifdef __KERNEL__
 	if (!dst)  printk(KERN_ERR);
@@ -368,11 +993,13 @@ __print_trace_point(int const flags, char *const dst, struct tracept const *cons
 
 	// PRINT(PRINT_OUT "(%ld) ", tp - tp_pool_copy);
 
+	time = clock_to_ns(tp->time);
+
 	if (print_ms) {
-		time = tp->time.tv_sec * 1000 + tp->time.tv_usec / 1000;
+		time /= 1000000;
 	}
-	else {
-		time = tp->time.tv_sec * 1000000 + tp->time.tv_usec;
+	else if (!print_ns) {
+		time /= 1000;
 	}
 
 	if (*prev_time) {
@@ -388,6 +1015,14 @@ __print_trace_point(int const flags, char *const dst, struct tracept const *cons
 			PRINT(printed, dst, "%+3d ", time_diff);
 		}
 	}
+	else if (print_ns) {
+		if (print_time) {
+			PRINT(printed, dst, "%6u.%09u ", (unsigned int) (time / 1000000000), (unsigned int) (time % 1000000000));
+		}
+		if (print_diff) {
+			PRINT(printed, dst, "%+9d ", time_diff);
+		}
+	}
 	else {
 		if (print_time) {
 			PRINT(printed, dst, "%6u.%06u ", (unsigned int) (time / 1000000), (unsigned int) (time % 1000000));
@@ -404,7 +1039,15 @@ __print_trace_point(int const flags, char *const dst, struct tracept const *cons
 		PRINT(printed, dst, "%5d ", tp->line);
 	}
 
-	PRINT(printed, dst, "%s\n", tp->msg);
+	if (tp->format) {
+		char msg[RT_MSG_MAX];
+
+		format_print(msg, tp);
+		PRINT(printed, dst, "%s\n", msg);
+	}
+	else {
+		PRINT(printed, dst, "%s\n", tp->msg);
+	}
 
 	*prev_time = time;
 
@@ -412,6 +1055,243 @@ __print_trace_point(int const flags, char *const dst, struct tracept const *cons
 }
 
 
+/**
+ * Private function record_next()
+ *
+ * pos
+ *   Byte position of a record in a ring
+ * size
+ *   Bytes of the record
+ *
+ * Return
+ *   Position of the next record, see struct tp_ring.
+ *
+*/
+
+static inline unsigned int
+record_next(unsigned int pos, unsigned int const size)
+{
+	unsigned int const left = ring_size - ((pos + size) & ring_mask);
+
+	pos += size;
+	return left < RECORD_MAX ? pos + left : pos;
+}
+
+
+/**
+ * Private function ring_copy()
+ * Copies the tracepts of a ring for printing, without stopping its writer.
+ *
+ * ring
+ *   Ring to copy
+ * incremental
+ *   If set, only the tracepts not yet printed are copied
+ *
+ * Return
+ *   1 if tracepts were lost since the previous incremental print, 
+ *   0 otherwise
+ *
+*/
+
+static int
+ring_copy(struct tp_ring *const ring, int const incremental)
+{
+	unsigned int tail = LOAD_ACQUIRE(ring->tail);
+	unsigned int const head = LOAD_ACQUIRE(ring->head);
+	unsigned int from = ring->copied;
+	int overrun = 0;
+
+	// The records copied by earlier reads are still in the copy
+	if ((int) (from - tail) < 0) {
+		from = tail;
+	}
+
+	while (from != head) {
+		unsigned int const offset = from & ring_mask;
+		unsigned int const len = head - from < ring_size - offset ? head - from : ring_size - offset;
+
+		memcpy(ring->copy + offset, ring->tps + offset, len);
+		from += len;
+	}
+
+	// The writer may have overwritten the oldest ones while we copied
+	READ_FENCE();
+	tail = LOAD_ACQUIRE(ring->tail);
+
+	if ((int) (head - tail) < 0) {
+		tail = head;
+	}
+
+	ring->copied = head;
+	ring->start  = tail;
+	ring->end    = head;
+
+	if (incremental) {
+		if ((int) (ring->printed - tail) < 0) {
+			overrun = 1;
+		}
+		else {
+			ring->start = ring->printed;
+		}
+	}
+
+	return overrun;
+}
+
+
+/**
+ * Private function pool_copy()
+ * Copies the tracepts of the shared pool for printing, without stopping its 
+ * writers. Only the slots written since the previous copy are copied. Every 
+ * slot is validated by its sequence number, see struct tracept. A slot that 
+ * was rewritten meanwhile is dropped from the copy.
+ *
+ * last
+ *   next_tp when the copy was started
+ *
+ * Return
+ *   The first tracept still being written, or last if all are complete.
+ *
+*/
+
+static unsigned int
+pool_copy(unsigned int const last)
+{
+	unsigned int from = pool_copied;
+	unsigned int pending = last;
+	unsigned int i;
+
+	if (last - from > (unsigned int) tp_pool_size) {
+		from = last - tp_pool_size;
+	}
+
+	for (i = from; i != last; ++i) {
+		struct tracept const *const tp = tp_pool + (i & tp_cnt_mask);
+		struct tracept *const copy = tp_pool_copy + (i & tp_cnt_mask);
+		unsigned int const seq = LOAD_ACQUIRE(tp->seq);
+
+		if (seq != 2 * i + 2) {
+			copy->src = NULL;
+
+			// Its writer has not finished, or not even started; the slot 
+			// still holds the previous tracept or nothing.
+			if (pending == last  &&  (seq == 2 * i + 1  ||  seq == 2 * (i - tp_pool_size) + 2  ||  
+				seq == 2 * (i - tp_pool_size) + 1  ||  0 == seq)) {
+				pending = i;
+			}
+			continue;
+		}
+
+		*copy = *tp;
+
+		READ_FENCE();
+
+		if (LOAD_ACQUIRE(tp->seq) != seq) {
+			copy->src = NULL;
+		}
+	}
+
+	// Slots being written are copied again next time
+	pool_copied = pending;
+
+	return pending;
+}
+
+
+/**
+ * Private function print_local_trace_stack()
+ * print_trace_stack() for RT_LAYOUT_LOCAL. The rings are copied and their
+ * copies merged by timestamp. Incremental printing keeps its position in
+ * the rings, *priv only counts the prints.
+ *
+ * See print_trace_stack() for params and return value.
+ *
+*/
+
+static int
+print_local_trace_stack(int const flags, char *const dst, int const size, int *const priv, int const needed_bufsize)
+{
+	int printed = 0;
+	int overrun = 0;
+	u64 prev_time = 0;
+	int i;
+
+	while (ATOMIC_TEST_AND_SET(reader_busy)) {
+		CPU_RELAX();
+	}
+
+	// Only keeps the rings from being reconfigured, writers don't lock
+	RDLOCK(print_rwlock);
+
+	for (i = 0; i < nr_rings; ++i) {
+		overrun |= ring_copy(&tp_rings[i], priv != NULL);
+	}
+
+	RDUNLOCK(print_rwlock);
+
+	// Print ellipsis to indicate that there might be a cap to previous print's tracepoints
+	if (overrun  &&  dst) {
+		PRINT(printed, dst + printed, "...%c", '\n');
+	}
+
+	for (;;) {
+		struct tp_ring *next = NULL;
+		struct tracept const *next_tp_copy = NULL;
+
+		for (i = 0; i < nr_rings; ++i) {
+			struct tp_ring *const ring = &tp_rings[i];
+			struct tracept const *tp;
+
+			if (ring->start == ring->end) {
+				continue;
+			}
+
+			tp = (struct tracept const *) (ring->copy + (ring->start & ring_mask));
+
+			// A torn record must not lead the walk past the end of the copy
+			if (tp->seq < RECORD_SIZE(0)  ||  tp->seq > RECORD_MAX  ||
+			    (int) (ring->end - record_next(ring->start, tp->seq)) < 0) {
+				ring->start = ring->end;
+
+				if (priv) {
+					ring->printed = ring->end;
+				}
+				continue;
+			}
+
+			if (!next  ||  tp_before(tp, next_tp_copy)) {
+				next = ring;
+				next_tp_copy = tp;
+			}
+		}
+
+		if (!next) {
+			break;
+		}
+
+		// Overly protective sanity check
+		if (dst  &&  printed > size - needed_bufsize) {
+			break;
+		}
+
+		printed += __print_trace_point(flags, dst + printed, next_tp_copy, &prev_time);
+		next->start = record_next(next->start, next_tp_copy->seq);
+
+		if (priv) {
+			next->printed = next->start;
+		}
+	}
+
+	if (priv) {
+		++*priv;
+	}
+
+	ATOMIC_CLEAR(reader_busy);
+
+	return printed;
+}
+
+
 /**
  * User API function print_trace_stack()
  * Prints out the whole tracept stack. Is multithread safe and can be called
@@ -439,9 +1319,10 @@ int
 print_trace_stack(int const flags, char *const dst, int size, int *const priv)
 {
 	//
-	// The tracept pool memory in whole is copied to another buffer
-	// for the print function to use. This is because copying the buffer
-	// is much faster than printing its contents.
+	// The tracept pool memory is copied to another buffer for the print 
+	// function to use. This is because copying the buffer is much faster 
+	// than printing its contents. Only the slots written since the previous
+	// print are copied, and the writers are not stopped, see pool_copy().
 	//
 	// On a core i5 machine it takes about 110 times longer to print out the
 	// contents than copy it for a userspace application. The timing was
@@ -453,7 +1334,7 @@ print_trace_stack(int const flags, char *const dst, int size, int *const priv)
 	// - 1000 print operations was ~8800 usec
 	// - 1000 memcpy operations was ~77 usec.
 	//
-	// The write lock must be held only when operating on common tp_pool buffer.
+	// The read lock only keeps the pool from being reconfigured meanwhile.
 	//
 
 	// static int const tp_pool_mem_size = (tp_cnt_mask+1) * sizeof(struct tracept);
@@ -461,6 +1342,7 @@ print_trace_stack(int const flags, char *const dst, int size, int *const priv)
 
 	int tp_num;
 	int last_tp;
+	unsigned int pending;
 	int printed = 0;
 	struct tracept const *tp;
 	u64 prev_time = 0;
@@ -472,6 +1354,15 @@ print_trace_stack(int const flags, char *const dst, int size, int *const priv)
 	int const needed_bufsize = 30 + 30 + RT_MSG_MAX;
 	struct tracept const *const tp_end = tp_pool_copy + tp_cnt_mask;
 
+	if (dst  &&  size < needed_bufsize) {
+		RT_DISABLING_ERR("Print buffer is too small\n");
+		return -1;
+	}
+
+	if (RT_LAYOUT_LOCAL == tp_layout) {
+		return print_local_trace_stack(flags, dst, size, priv, needed_bufsize);
+	}
+
 // static u64 cnts;
 // static u64 total;
 // static u64 gtotal;
@@ -480,22 +1371,24 @@ print_trace_stack(int const flags, char *const dst, int size, int *const priv)
 
 // GETTIMEOFDAY(&start);
 	
-	WRLOCK(print_rwlock);
-	last_tp = ATOMIC_READ(next_tp);
-	memcpy(tp_pool_copy, tp_pool, tp_pool_mem_size);
-	WRUNLOCK(print_rwlock);
-
-	
-	if (size < needed_bufsize) {
-		RT_DISABLING_ERR("Print buffer is too small\n");
-		return -1;
+	while (ATOMIC_TEST_AND_SET(reader_busy)) {
+		CPU_RELAX();
 	}
 
+	RDLOCK(print_rwlock);
+	last_tp = ATOMIC_READ(next_tp);
+	pending = pool_copy(last_tp);
+	RDUNLOCK(print_rwlock);
+
 // GETTIMEOFDAY(&stop);
 
 	// Adjust tp_num to the oldest record of ring buffer.
 	if (priv) {
+		// Tracepts still being written are printed next time
+		last_tp = pending;
+
 		if (last_tp == *priv) {
+			ATOMIC_CLEAR(reader_busy);
 			return 0;
 		}
 
@@ -558,6 +1451,8 @@ print_trace_stack(int const flags, char *const dst, int size, int *const priv)
 		*priv = tp_num;
 	}
 
+	ATOMIC_CLEAR(reader_busy);
+
 	return printed;
 }
 
@@ -565,6 +1460,34 @@ print_trace_stack(int const flags, char *const dst, int size, int *const priv)
 
 #ifdef __KERNEL__
 
+/**
+ * Private function tracepts_unread()
+ * Tells if there are tracepts the reader has not printed yet.
+ *
+ * pos
+ *   The reader's position, as in print_trace_stack() priv
+ *
+*/
+
+static int
+tracepts_unread(unsigned int const *const pos)
+{
+	int i;
+
+	if (RT_LAYOUT_SHARED == tp_layout) {
+		return *pos != ATOMIC_READ(next_tp);
+	}
+
+	for (i = 0; i < nr_rings; ++i) {
+		if (tp_rings[i].printed != LOAD_ACQUIRE(tp_rings[i].head)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
 /**
  * Kernel callback function cdev_open()
  *
@@ -587,8 +1510,17 @@ cdev_open(struct inode *const inode, struct file *const filp)
 		return -EBUSY;
 	}
 
-	// Place print pointer to 1 record behind the oldest one
-	filp->f_pos = (unsigned int) (ATOMIC_READ(next_tp) - tp_pool_size - 1);
+	// Place print pointer to 1 record behind the oldest one
+	filp->f_pos = (unsigned int) (ATOMIC_READ(next_tp) - tp_pool_size - 1);
+
+	if (RT_LAYOUT_LOCAL == tp_layout) {
+		int i;
+
+		for (i = 0; i < nr_rings; ++i) {
+			tp_rings[i].printed = LOAD_ACQUIRE(tp_rings[i].tail);
+		}
+	}
+
 	return nonseekable_open(inode, filp);
 }
 
@@ -626,7 +1558,7 @@ cdev_read(struct file *const filp, char __user *const buf, size_t count, loff_t
 	int ret;
 
 	do {
-		while (*(unsigned int *) offp == ATOMIC_READ(next_tp)) {
+		while (!tracepts_unread((unsigned int *) offp)) {
 			if (filp->f_flags & O_NONBLOCK) {
 				return -EAGAIN;
 			}
@@ -637,7 +1569,7 @@ cdev_read(struct file *const filp, char __user *const buf, size_t count, loff_t
 				return 0;
 			}
 
-			if (wait_event_interruptible(read_queue, *(unsigned int *) offp != ATOMIC_READ(next_tp))) {
+			if (wait_event_interruptible(read_queue, tracepts_unread((unsigned int *) offp))) {
 				return -ERESTARTSYS;
 			}
 		}
@@ -689,10 +1621,67 @@ cdev_write(struct file *const filp, char const __user *const buf, size_t const c
 #endif  // __KERNEL__
 
 
+#ifndef __KERNEL__
+
+/**
+ * Private function thread_ring_release()
+ *
+ * Gives the calling thread's ring back when the thread exits. Its tracepts
+ * are kept. Rings of an earlier configuration are gone already.
+ *
+*/
+
+static void
+thread_ring_release(void *)
+{
+	if (thread_ring  &&  thread_ring_generation == ring_generation) {
+		ATOMIC_CLEAR(thread_ring->in_use);
+	}
+}
+
+
+/**
+ * Private function thread_ring_get()
+ *
+ * Gives the calling thread's ring, taking a free one on the first call.
+ *
+ * Return
+ *   The ring, or NULL if all rings are taken.
+ *
+*/
+
+static inline struct tp_ring *
+thread_ring_get(void)
+{
+	int i;
+
+	if (thread_ring_generation == ring_generation) {
+		return thread_ring;
+	}
+
+	thread_ring = NULL;
+	thread_ring_generation = ring_generation;
+
+	for (i = 0; i < nr_rings; ++i) {
+		if (!ATOMIC_TEST_AND_SET(tp_rings[i].in_use)) {
+			thread_ring = &tp_rings[i];
+			pthread_setspecific(ring_key, thread_ring);
+			break;
+		}
+	}
+
+	return thread_ring;
+}
+
+#endif  // ! __KERNEL__
+
+
 /**
  * Private function environment_check()
  *
- * Reads user set environment variables for runtrace facility configuration data.
+ * Reads user set environment variables for runtrace facility configuration data:
+ * RT_POOL_SIZE, RT_POOL_LAYOUT ("shared" or "local") and RT_CLOCK ("raw", 
+ * "tsc" or "coarse").
  * Reconfigure runtrace if such variables is found.
  *
  * Return
@@ -707,6 +1696,8 @@ environment_check(int *const pool_size)
 	(void) pool_size;
 #else
 	char const *const pool_size_env = getenv("RT_POOL_SIZE");
+	char const *const layout_env = getenv("RT_POOL_LAYOUT");
+	char const *const clock_env = getenv("RT_CLOCK");
 	int i = 0;
 
 	if (pool_size_env) {
@@ -715,6 +1706,22 @@ environment_check(int *const pool_size)
 			*pool_size = i;
 		}
 	}
+
+	if (layout_env) {
+		tp_layout = strcmp(layout_env, "local") ? RT_LAYOUT_SHARED : RT_LAYOUT_LOCAL;
+	}
+
+	if (clock_env) {
+		if (!strcmp(clock_env, "tsc")) {
+			tp_clock = RT_CLOCK_TSC;
+		}
+		else if (!strcmp(clock_env, "coarse")) {
+			tp_clock = RT_CLOCK_COARSE;
+		}
+		else {
+			tp_clock = RT_CLOCK_RAW;
+		}
+	}
 #endif
 }
 
@@ -748,6 +1755,42 @@ runtrace_flush_on_abort(int const enable, int const print_flags)
 #endif  // __KERNEL__
 
 
+/**
+ * Private function free_pools()
+ *
+ * Frees the tracept pool or rings and the vsprintf buffers.
+ *
+ * Return
+ *   void
+ *
+*/
+
+static void
+free_pools(void)
+{
+	if (tp_pool) {
+		FREE(tp_pool);
+		tp_pool = NULL;
+	}
+	if (tp_pool_copy) {
+		FREE(tp_pool_copy);
+		tp_pool_copy = NULL;
+	}
+	if (tp_rings) {
+		FREE(tp_rings);
+		tp_rings = NULL;
+	}
+	if (tp_ring_mem) {
+		FREE(tp_ring_mem);
+		tp_ring_mem = NULL;
+	}
+	if (vsprint_buffer) {
+		FREE(vsprint_buffer);
+		vsprint_buffer = NULL;
+	}
+}
+
+
 /**
  * User API function runtrace_reconfigure()
  *
@@ -760,7 +1803,9 @@ runtrace_flush_on_abort(int const enable, int const print_flags)
  *
  * If pool_size passes sanity checks, the lock is obtained (if needed) and the
  * tracept pool is reinitialised. This process clears the pool of its previous
- * contents.
+ * contents. With RT_LAYOUT_LOCAL the rings are written without the lock, so
+ * no tracepts may be created meanwhile. Every ring has pool_size * 
+ * RT_RECORD_AVG bytes, at least 4 of the largest records.
  *
  * Return
  *   -1 if pool_size sanity check failed or memory allocation fails.
@@ -798,36 +1843,64 @@ runtrace_reconfigure(int nr_of_threads, int const pool_size)
 	tp_cnt_mask = tp_pool_size - 1;  // Forms a mask from 2^size
 	tp_pool_mem_size = tp_pool_size * sizeof(struct tracept);
 
+	ring_size = tp_pool_size * RT_RECORD_AVG;
+	while (ring_size < 4 * RECORD_MAX) {
+		ring_size <<= 1;
+	}
+	ring_mask = ring_size - 1;
+
 	
-	if (tp_pool)
-		FREE(tp_pool);
-	if (tp_pool_copy)
-		FREE(tp_pool_copy);
-	if (vsprint_buffer)
-		FREE(vsprint_buffer);
+#ifdef __KERNEL__
+	nr_rings = nr_cpu_ids;
+#else
+	nr_rings = max_threads;
+	++ring_generation;
+#endif
+
+	free_pools();
 
-	tp_pool = (struct tracept *) MALLOC(tp_pool_mem_size);
-	tp_pool_copy = (struct tracept *) MALLOC(tp_pool_mem_size);
+	if (RT_LAYOUT_LOCAL == tp_layout) {
+		tp_rings = (struct tp_ring *) MALLOC(nr_rings * sizeof(struct tp_ring));
+		tp_ring_mem = (char *) MALLOC(2 * nr_rings * ring_size);
+	}
+	else {
+		tp_pool = (struct tracept *) MALLOC(tp_pool_mem_size);
+		tp_pool_copy = (struct tracept *) MALLOC(tp_pool_mem_size);
+	}
 	vsprint_buffer = (struct vspb_container *) MALLOC(max_threads * sizeof(struct vspb_container));
 
 
-	if (!tp_pool  ||  !tp_pool_copy  ||  !vsprint_buffer) {
-		if (tp_pool) {
-			FREE(tp_pool); tp_pool = NULL;
-		}
-		if (tp_pool_copy) {
-			FREE(tp_pool_copy); tp_pool_copy = NULL;
-		}
-		if (vsprint_buffer) {
-			FREE(vsprint_buffer); vsprint_buffer = NULL;
-		}
+	if ((RT_LAYOUT_LOCAL == tp_layout ? !tp_rings  ||  !tp_ring_mem : !tp_pool  ||  !tp_pool_copy)  ||  !vsprint_buffer) {
+		free_pools();
 
-		RT_DISABLING_ERR("Cannot allocate %d bytes for tracept pool and its copy buffer", tp_pool_mem_size);
+		RT_DISABLING_ERR("Cannot allocate %d bytes for tracept pool and its copy buffer", 
+			RT_LAYOUT_LOCAL == tp_layout ? 2 * nr_rings * (int) ring_size : tp_pool_mem_size);
 		return -1;
 	}
 
 
-	memset(tp_pool, 0, tp_pool_mem_size);
+	if (RT_LAYOUT_LOCAL == tp_layout) {
+		memset(tp_ring_mem, 0, 2 * nr_rings * ring_size);
+
+		for (i=0; i<nr_rings; ++i) {
+			tp_rings[i].head    = 0;
+			tp_rings[i].tail    = 0;
+			tp_rings[i].printed = 0;
+			tp_rings[i].copied  = 0;
+			tp_rings[i].start   = 0;
+			tp_rings[i].end     = 0;
+#ifndef __KERNEL__
+			ATOMIC_CLEAR(tp_rings[i].in_use);
+#endif
+			tp_rings[i].tps  = tp_ring_mem + 2 * i * ring_size;
+			tp_rings[i].copy = tp_rings[i].tps + ring_size;
+		}
+	}
+	else {
+		memset(tp_pool, 0, tp_pool_mem_size);
+		memset(tp_pool_copy, 0, tp_pool_mem_size);
+		pool_copied = ATOMIC_READ(next_tp);
+	}
 	for (i=0; i<max_threads; ++i) {
 		ATOMIC_CLEAR(vsprint_buffer[i].in_use);
 		vsprint_buffer[i].next = &vsprint_buffer[i+1];
@@ -870,6 +1943,7 @@ runtrace_init(int const nr_of_threads)
 	nr_cpus = NR_CPUS;
 
 	environment_check(&pool_size);
+	clock_calibrate();
 
 	if (runtrace_reconfigure(nr_of_threads, pool_size) < 0 ) {
 		return -1;
@@ -878,6 +1952,10 @@ runtrace_init(int const nr_of_threads)
 	LOCK_INIT(print_rwlock);
 	lock_initialised = 1;
 
+#ifndef __KERNEL__
+	pthread_key_create(&ring_key, thread_ring_release);
+#endif
+
 
 #ifdef __KERNEL__
 	if (alloc_chrdev_region(&dev, 0, 1, "runtrace")) {
@@ -930,30 +2008,103 @@ runtrace_exit(void)
 		print_vsbp_underrun_notice();
 	}
 
-	if (tp_pool) {
-		FREE(tp_pool);
-		tp_pool = NULL;
-	}
-	if (tp_pool_copy) {
-		FREE(tp_pool_copy);
-		tp_pool_copy = NULL;
+#ifndef __KERNEL__
+	if (ATOMIC_READ(ring_lost_tps)) {
+		print_ring_underrun_notice();
 	}
-	if (vsprint_buffer) {
-		FREE(vsprint_buffer);
-		vsprint_buffer = NULL;
+
+	if (lock_initialised) {
+		pthread_key_delete(ring_key);
 	}
+#endif
+
+	free_pools();
 
 	LOCK_DESTROY(print_rwlock);
 	lock_initialised = 0;
 }
 
 
+/**
+ * User API function runtrace_layout()
+ *
+ * layout
+ *   RT_LAYOUT_SHARED or RT_LAYOUT_LOCAL, see runtrace.h
+ *
+ * Selects the tracept pool layout. Writers read the layout without the lock,
+ * so it can't be switched safely while they run: call before runtrace_init()
+ * or after runtrace_exit(). RT_POOL_LAYOUT environment variable overrides it
+ * at runtrace_init().
+ *
+ * Return
+ *   -1 if layout is unknown or runtrace is initialised.
+ *   0  on success
+ *
+*/
+
+int
+runtrace_layout(int const layout)
+{
+	if (RT_LAYOUT_SHARED != layout  &&  RT_LAYOUT_LOCAL != layout) {
+		RT_WARNING("Unknown layout %d in %s\n", layout, __FUNCTION__);
+		return -1;
+	}
+
+	if (lock_initialised) {
+		RT_WARNING("%s called after runtrace_init()\n", __FUNCTION__);
+		return -1;
+	}
+
+	tp_layout = layout;
+
+	return 0;
+}
+
+
+/**
+ * User API function runtrace_clock()
+ *
+ * clock
+ *   RT_CLOCK_RAW, RT_CLOCK_TSC or RT_CLOCK_COARSE, see runtrace.h
+ *
+ * Selects the timestamp source of tracepts. Writers read the clock without
+ * the lock, so it can't be switched safely while they run: call before
+ * runtrace_init() or after runtrace_exit(). RT_CLOCK environment variable
+ * overrides it at runtrace_init(), where RT_CLOCK_TSC takes 10 ms to calibrate.
+ *
+ * Return
+ *   -1 if clock is unknown or runtrace is initialised.
+ *   0  on success
+ *
+*/
+
+int
+runtrace_clock(int const clock)
+{
+	if (RT_CLOCK_RAW != clock  &&  RT_CLOCK_TSC != clock  &&  RT_CLOCK_COARSE != clock) {
+		RT_WARNING("Unknown clock %d in %s\n", clock, __FUNCTION__);
+		return -1;
+	}
+
+	if (lock_initialised) {
+		RT_WARNING("%s called after runtrace_init()\n", __FUNCTION__);
+		return -1;
+	}
+
+	tp_clock = clock;
+
+	return 0;
+}
+
+
 /**
  * User API function make_tracept()
  * Creates a tracept. This is multithread safe and can be called from interrupt context.
  *
  * Several instances of make_tracept can run parallel in read lock protected section.
- * The only critical data, next_tp, is read and incremented atomically.
+ * The only critical data, next_tp, is read and incremented atomically. Printing
+ * does not block it.
+ * With RT_LAYOUT_LOCAL no lock nor atomic operation is needed, see struct tp_ring.
  *
  * line
  *   Line number of the calling context.
@@ -964,42 +2115,142 @@ runtrace_exit(void)
  * msg
  *   Ptr to a buffer ending on null-terminated string containing RT_MSG_MAX characters
  *   at most. Can be NULL.
+ * format, args
+ *   (Private) The format and arguments of a binary tracept, see tpbinary().
+ *
+ * fill_tracept() gives the bytes of msg used, see RECORD_SIZE().
 */
 
-void
-make_tracept(int const line, char const *const src, char const *const msg)
+static inline int
+fill_tracept(struct tracept *const tp, int const line, char const *const src, char const *const msg,
+	struct rt_format const *const format, va_list *const args)
+{
+	int len;
+
+	tp->time = clock_ticks();
+	tp->line = line;
+	tp->src = src;
+	tp->format = format;
+	
+	if (format) {
+		return format_args(tp->msg, format, args);
+	}
+
+	if (!msg) {
+		*tp->msg = '\0';
+		return 1;
+	}
+
+	len = strnlen(msg, RT_MSG_MAX - 1);
+	memcpy(tp->msg, msg, len);
+	tp->msg[len] = '\0';
+
+	return len + 1;
+}
+
+
+/**
+ * Private function make_local_tracept()
+ * make_tracept() for RT_LAYOUT_LOCAL. See struct tp_ring.
+ *
+*/
+
+static inline void
+make_local_tracept(int const line, char const *const src, char const *const msg,
+	struct rt_format const *const format, va_list *const args)
+{
+	struct tp_ring *ring;
+	struct tracept *tp;
+	unsigned int head;
+	unsigned int tail;
+#ifdef __KERNEL__
+	unsigned long irq_flags;
+
+	// Interrupts on this CPU would write the same ring
+	local_irq_save(irq_flags);
+	ring = tp_rings + smp_processor_id();
+#else
+	ring = thread_ring_get();
+
+	if (!ring) {
+		ATOMIC_RET_INC(ring_lost_tps);
+		return;
+	}
+#endif
+
+	head = ring->head;
+	tail = ring->tail;
+
+	// Free the largest record's room after head. Readers must see tail 
+	// moved before the old records are overwritten.
+	if (head - tail > ring_size - RECORD_MAX) {
+		do {
+			tail = record_next(tail, ((struct tracept *) (ring->tps + (tail & ring_mask)))->seq);
+		} while (head - tail > ring_size - RECORD_MAX);
+
+		STORE_RELEASE(ring->tail, tail);
+		WRITE_FENCE();
+	}
+
+	tp = (struct tracept *) (ring->tps + (head & ring_mask));
+	tp->seq = RECORD_SIZE(fill_tracept(tp, line, src, msg, format, args));
+	STORE_RELEASE(ring->head, record_next(head, tp->seq));
+
+#ifdef __KERNEL__
+	local_irq_restore(irq_flags);
+#endif
+}
+
+
+static inline void
+put_tracept(int const line, char const *const src, char const *const msg,
+	struct rt_format const *const format, va_list *const args)
 {
 	struct tracept *tp;
 
 
-	if (!tp_pool) {
+	if (!tp_pool  &&  !tp_rings) {
 		RT_DISABLING_ERR("You did not call init_tracepts()\n");
 		// When in kernel, try to initialise runtrace facility().
 		// Userspace app calls abort() in DISABLING_ERR
 		runtrace_init(1);
 	}
-	
 
-	RDLOCK(print_rwlock);
+	if (RT_LAYOUT_LOCAL == tp_layout) {
+		make_local_tracept(line, src, msg, format, args);
+	}
+	else {
+		unsigned int n;
 
-	// Although multiple threads run parallel in read lock protected section, the next_tp
-	// incrementation must be guarded against printing function. 
-	// Printing function calls invokes write lock to prevent other threads from changing 
-	// contents of the tracept buffer and the next_tp variable.
-	tp = tp_pool + (tp_cnt_mask & ATOMIC_RET_INC(next_tp));
+		// Multiple threads run parallel in read lock protected section. Only 
+		// reconfiguring takes the write lock. Readers check the slot's sequence
+		// number, see struct tracept.
+		RDLOCK(print_rwlock);
 
-	GETTIMEOFDAY(&tp->time);
-	tp->line = line;
-	tp->src = src;
-	
-	if (!msg)
-		*tp->msg = '\0';
-	else 
-		strncpy(tp->msg, msg, RT_MSG_MAX);
+		n = ATOMIC_RET_INC(next_tp);
+		tp = tp_pool + (tp_cnt_mask & n);
 
-	RDUNLOCK(print_rwlock);
+		tp->seq = 2 * n + 1;
+		WRITE_FENCE();
+		fill_tracept(tp, line, src, msg, format, args);
+		STORE_RELEASE(tp->seq, 2 * n + 2);
+
+		RDUNLOCK(print_rwlock);
+	}
 
-	wake_up_interruptible(&read_queue);
+#ifdef __KERNEL__
+	// Waking up takes the queue's lock; only pay for it when a reader waits
+	if (wq_has_sleeper(&read_queue)) {
+		wake_up_interruptible(&read_queue);
+	}
+#endif
+}
+
+
+void
+make_tracept(int const line, char const *const src, char const *const msg)
+{
+	put_tracept(line, src, msg, NULL, NULL);
 }
 
 
@@ -1018,12 +2269,11 @@ make_tracept(int const line, char const *const src, char const *const msg)
  *
 */
 
-int
-tpprintf(int line, char const *src, char const *fmt, ...)
+static int
+vtpprintf(int const line, char const *const src, char const *const fmt, va_list args)
 {
 	struct vspb_container *container = vsprint_buffer;
 	int printed;
-	va_list args;
 
 
 	if (!vsprint_buffer) {
@@ -1059,14 +2309,62 @@ tpprintf(int line, char const *src, char const *fmt, ...)
 		}
 	}
 
-	va_start (args, fmt);
 	printed = vsnprintf(container->buf, RT_MSG_MAX, fmt, args);
 	
 	make_tracept(line, src, container->buf);
 	ATOMIC_CLEAR(container->in_use);
 
+	return printed;
+}
+
+
+int
+tpprintf(int line, char const *src, char const *fmt, ...)
+{
+	int printed;
+	va_list args;
+
+	va_start (args, fmt);
+	printed = vtpprintf(line, src, fmt, args);
 	va_end(args);
 
 	return printed;
 }
 
+
+/**
+ * User API function tpbinary()
+ *
+ * line, src
+ *   See make_tracept()
+ * format
+ *   The call site's static format, see TP_FILE_B in runtrace.h
+ *
+ * Creates a binary tracept: the arguments are copied as they are and 
+ * printed with the format only when the trace is printed. The format string
+ * is parsed on the first call. Formats that binary tracepts don't support 
+ * are printed at once as with tpprintf().
+ *
+*/
+
+void
+tpbinary(int const line, char const *const src, struct rt_format *const format, ...)
+{
+	va_list args;
+
+	if (!LOAD_ACQUIRE(format->state)) {
+		format_parse(format);
+	}
+
+	va_start(args, format);
+
+	if (1 == LOAD_ACQUIRE(format->state)) {
+		put_tracept(line, src, NULL, format, &args);
+	}
+	else {
+		vtpprintf(line, src, format->fmt, args);
+	}
+
+	va_end(args);
+}
+
@@ -17,6 +17,7 @@
 
 #define RT_POOL_SIZE_DFLT   256
 #define RT_MSG_MAX          200  // Max user message length per tracepoint
+#define RT_RECORD_AVG       64   // Ring bytes per pool_size tracepoint with RT_LAYOUT_LOCAL
 
 
 /**
@@ -34,6 +35,46 @@
 #define TP_FUNK_P(fmt...)  tpprintf(__LINE__, __FUNCTION__, fmt)
 
 
+/**
+ * Binary tracepoints.
+ *
+ * Like the _P macros, but the arguments are stored as they are and the 
+ * message is formatted only when the trace is printed. This costs about as
+ * much as TP_FILE. Every call site registers its format string once, so 
+ * 'fmt' must be a string literal. Strings (%s) are copied, up to what fits
+ * in RT_MSG_MAX bytes with the other arguments, or up to a '*' precision
+ * (%.*s). Formats with %n, wide strings, strings with a literal precision,
+ * floating point or %p extensions (%pS, %pI4...) in kernel or more than
+ * RT_FMT_ARGS_MAX arguments are formatted at once as with the _P macros.
+*/
+
+#define RT_FMT_ARGS_MAX  16
+
+struct rt_format
+{
+	char const *fmt;
+	int state;       // 0 not parsed yet, 2 being parsed, 1 binary, -1 formatted at once
+	int nr_args;
+	int size;        // Bytes of the arguments other than strings
+	int strings;
+	unsigned char args[RT_FMT_ARGS_MAX];  // Classes of the arguments
+};
+
+#define TP_FILE_B(fmt, args...)  TP_BINARY(__FILE__, fmt, ## args)
+#define TP_FUNK_B(fmt, args...)  TP_BINARY(__FUNCTION__, fmt, ## args)
+
+#define TP_BINARY(src, fmt, args...)  ({ \
+	static struct rt_format rt_format_ = { fmt }; \
+	if (0)  tp_format_check(fmt, ## args); \
+	tpbinary(__LINE__, src, &rt_format_, ## args); })
+
+static inline void __attribute__((format(printf, 1, 2)))
+tp_format_check(char const *fmt, ...)
+{
+	(void) fmt;
+}
+
+
 /**
  * Printing flags.
  * Used with print_trace_stack() flags argument.
@@ -44,14 +85,38 @@
 #define RT_PRINT_LINE    0x04  // Print line from where the tracepoint was created
 #define RT_PRINT_SRC     0x08  // Print source file/function from where the tracepoint was created
 #define RT_PRINT_TIME_MS 0x10  // Print times in ms instead of us
+#define RT_PRINT_TIME_NS 0x20  // Print times in ns instead of us
 
 #define RT_PRINT_DEFAULT   (RT_PRINT_TIME | RT_PRINT_LINE | RT_PRINT_SRC | RT_PRINT_TIME_MS)
-#define RT_PRINT_ALL       ((~0) & (~RT_PRINT_TIME_MS))
-#define RT_PRINT_ALL_MS    (~0)
+#define RT_PRINT_ALL       ((~0) & (~(RT_PRINT_TIME_MS | RT_PRINT_TIME_NS)))
+#define RT_PRINT_ALL_MS    ((~0) & (~RT_PRINT_TIME_NS))
+#define RT_PRINT_ALL_NS    ((~0) & (~RT_PRINT_TIME_MS))
+
+
+/**
+ * Tracept pool layouts.
+ * Used with runtrace_layout(), before runtrace_init(). Switching the layout
+ * while tracepoints are made is not safe and is refused.
+*/
+
+#define RT_LAYOUT_SHARED  0  // One pool for all, a shared counter per tracepoint
+#define RT_LAYOUT_LOCAL   1  // A ring per thread (userspace) or CPU (kernel), no atomics
+
+
+/**
+ * Timestamp sources.
+ * Used with runtrace_clock(), before runtrace_init(). Switching the clock
+ * while tracepoints are made is not safe and is refused.
+*/
+
+#define RT_CLOCK_RAW     0  // CLOCK_MONOTONIC_RAW (kernel: ktime_get_raw_ns)
+#define RT_CLOCK_TSC     1  // CPU cycle counter, calibrated at runtrace_init()
+#define RT_CLOCK_COARSE  2  // CLOCK_MONOTONIC_COARSE, cheapest, resolution of a timer tick
 
 
 void make_tracept(int line, char const *src, char const *msg);
 int  tpprintf(int line, char const *src, char const *fmt, ...);
+void tpbinary(int line, char const *src, struct rt_format *format, ...);
 
 
 #ifndef __KERNEL__
@@ -59,6 +124,8 @@ void runtrace_flush_on_abort(int enable, int print_flags = RT_PRINT_DEFAULT);
 #endif
 
 int  runtrace_reconfigure(int nr_threads, int pool_size);
+int  runtrace_layout(int layout);
+int  runtrace_clock(int clock);
 
 int  runtrace_init(int nr_threads);
 void runtrace_exit(void);
@@ -18,6 +18,8 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "../runtrace.h"
 
 
@@ -26,6 +28,16 @@ static int running = 1;
 static pthread_t *thread;
 static int numberOfThreads;
 
+static int volatile checking;
+static int failures;
+static char checkBuf[1 << 20];
+
+#define CHECK(cond, fmt, args...)  \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: " fmt "\n", __FUNCTION__, __LINE__, ## args); \
+		++failures; \
+	}
+
 
 static void *
 writerThread(void *data)
@@ -49,6 +61,242 @@ writerThread(void *data)
 
 
 
+/**
+ * Writes tracepts for checkIncremental() in bursts, so that some prints
+ * find every ring intact and some find them overrun.
+*/
+
+static void *
+checkWriterThread(void *data)
+{
+	int i = 0;
+	int const threadNum = (int) (size_t) data;
+
+	while (checking) {
+		TP_FILE_P("Thread %d, write %d", threadNum, i++);
+
+		if (0 == i % 16) {
+			usleep(1000);
+		}
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Prints the tracepts of writer threads incrementally and checks that no
+ * tracept is printed twice, that tracepts are lost only where the print
+ * starts with "..." and that "..." is printed only when some were lost.
+ * With the local layout the merged rings must print in timestamp order.
+*/
+
+static void
+checkIncremental(int const layout)
+{
+	int const nr = numberOfThreads < 4 ? numberOfThreads : 4;
+	int last[4] = { -1, -1, -1, -1 };
+	pthread_t writers[4];
+	int priv = 0;
+	int overruns = 0;
+	int records = 0;
+	int i, k;
+
+	runtrace_layout(layout);
+	runtrace_init(nr + 1);
+
+	checking = 1;
+
+	for (i = 0; i < nr; ++i) {
+		pthread_create(&writers[i], NULL, checkWriterThread, (void *) (long long) i);
+	}
+
+	for (k = 0; k < 110; ++k) {
+		unsigned long long prevTime = 0;
+		int overrun = 0;
+		int lost = 0;
+		int n;
+		char *line;
+
+		usleep(k < 100 ? 1000 : 50000);
+
+		n = print_trace_stack(RT_PRINT_TIME | RT_PRINT_TIME_NS, checkBuf, sizeof(checkBuf), &priv);
+		checkBuf[n > 0 ? n : 0] = '\0';
+
+		for (line = strtok(checkBuf, "\n"); line; line = strtok(NULL, "\n")) {
+			unsigned int sec, ns;
+			int t, w;
+
+			if (!strcmp(line, "...")) {
+				CHECK(line == checkBuf, "ellipsis after a tracept");
+				overrun = 1;
+				continue;
+			}
+
+			if (4 != sscanf(line, "%u.%u Thread %d, write %d", &sec, &ns, &t, &w)) {
+				CHECK(0, "unexpected line '%s'", line);
+				continue;
+			}
+
+			CHECK(w > last[t], "thread %d write %d printed again after %d", t, w, last[t]);
+			lost |= w > last[t] + 1;
+			last[t] = w;
+			++records;
+
+			if (RT_LAYOUT_LOCAL == layout) {
+				unsigned long long const time = sec * 1000000000ULL + ns;
+
+				CHECK(time >= prevTime, "write %d of thread %d printed out of order", w, t);
+				prevTime = time;
+			}
+		}
+
+		CHECK(lost == overrun, "print %d: lost %d, ellipsis %d", k, lost, overrun);
+		overruns += overrun;
+	}
+
+	checking = 0;
+
+	for (i = 0; i < nr; ++i) {
+		pthread_join(writers[i], NULL);
+	}
+
+	runtrace_exit();
+
+	fprintf(stderr, "Incremental %s: %d tracepts, %d overrun prints\n", 
+		RT_LAYOUT_LOCAL == layout ? "local" : "shared", records, overruns);
+}
+
+
+/**
+ * Stamps tracepts around a 100 ms sleep with the given clock and checks
+ * that their times are monotonic, fall within the wall time read around
+ * them and show the sleep at the right scale.
+*/
+
+static void
+checkClock(int const clock)
+{
+	unsigned long long const slack = 20000000ULL;
+	unsigned long long first = 0, prevTime = 0;
+	unsigned long long wall0, wall1;
+	struct timespec ts;
+	int records = 0;
+	int n, i;
+	char *line;
+
+	runtrace_clock(clock);
+	runtrace_init(2);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	for (i = 0; i < 100; ++i) {
+		TP_FILE("Clock");
+	}
+	usleep(100000);
+	TP_FILE("Clock");
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall1 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	n = print_trace_stack(RT_PRINT_TIME | RT_PRINT_TIME_NS, checkBuf, sizeof(checkBuf), NULL);
+	checkBuf[n > 0 ? n : 0] = '\0';
+
+	for (line = strtok(checkBuf, "\n"); line; line = strtok(NULL, "\n")) {
+		unsigned int sec, ns;
+		unsigned long long time;
+
+		if (2 != sscanf(line, "%u.%u Clock", &sec, &ns)) {
+			CHECK(0, "clock %d: unexpected line '%s'", clock, line);
+			continue;
+		}
+
+		time = sec * 1000000000ULL + ns;
+		CHECK(time >= prevTime, "clock %d: time went back by %llu ns", clock, prevTime - time);
+		prevTime = time;
+
+		if (!records++) {
+			first = time;
+		}
+	}
+
+	CHECK(101 == records, "clock %d: %d tracepts", clock, records);
+	CHECK(first + slack >= wall0, "clock %d: first stamp %llu ns before", clock, wall0 - first);
+	CHECK(prevTime <= wall1 + slack, "clock %d: last stamp %llu ns after", clock, prevTime - wall1);
+	CHECK(prevTime - first + slack >= 100000000ULL, "clock %d: slept only %llu ns", clock, prevTime - first);
+
+	runtrace_exit();
+
+	fprintf(stderr, "Clock %d: slept %llu ns\n", clock, prevTime - first);
+}
+
+
+/**
+ * Makes a formatted and a binary tracept of the same call on one line.
+*/
+
+#define CHECK_BINARY(fmt, args...)  \
+	do { TP_FILE_P(fmt, ## args); TP_FILE_B(fmt, ## args); } while (0)
+
+
+/**
+ * Checks that binary tracepts print as the formatted ones, also when the
+ * format makes them fall back to formatting at once.
+*/
+
+static void
+checkBinary(int const layout)
+{
+	char const *prev = NULL;
+	int pairs = 0;
+	int written;
+	int n;
+	char *line;
+	char *page;
+	char *unterminated;
+
+	// Reading past the 3 chars of the string would fault at the next page
+	page = (char *) mmap(NULL, 2 * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	mprotect(page + 4096, 4096, PROT_NONE);
+	unterminated = page + 4096 - 3;
+	memcpy(unterminated, "abc", 3);
+
+	runtrace_layout(layout);
+	runtrace_init(2);
+
+	CHECK_BINARY("int %d %u %x %c", -5, 7u, 255, 'Z');
+	CHECK_BINARY("long %ld %lld %zu", -123456789012L, 1LL << 40, (size_t) 42);
+	CHECK_BINARY("width [%*d] [%-*.*s]", 6, 42, 8, 3, "abcdef");
+	CHECK_BINARY("string %s %s", "first", "second");
+	CHECK_BINARY("double %f %.3g", 3.14159, 1e-7);
+	CHECK_BINARY("precision [%.*s] [%-6.*s] [%.2s]", 3, unterminated, 2, "abcdef", "xyz");
+	CHECK_BINARY("percent %d%%", 50);
+	CHECK_BINARY("written %d%n", 1, &written);
+	CHECK_BINARY("too many %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d",
+		1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
+
+	n = print_trace_stack(0, checkBuf, sizeof(checkBuf), NULL);
+	checkBuf[n > 0 ? n : 0] = '\0';
+
+	for (line = strtok(checkBuf, "\n"); line; line = strtok(NULL, "\n")) {
+		if (!prev) {
+			prev = line;
+			continue;
+		}
+
+		CHECK(!strcmp(prev, line), "'%s' printed as '%s'", prev, line);
+		prev = NULL;
+		++pairs;
+	}
+
+	CHECK(9 == pairs  &&  !prev, "%d pairs printed", pairs);
+
+	runtrace_exit();
+	munmap(page, 2 * 4096);
+}
+
+
 void sighandler(int s)
 {
 	switch (s) {
@@ -64,6 +312,7 @@ int
 main(void)
 {
 	int i;
+	char *layoutEnv, *clockEnv;
 	
 
 	if ((numberOfThreads = sysconf(_SC_NPROCESSORS_ONLN) * 2) < 1) {
@@ -76,6 +325,30 @@ main(void)
 
 	signal(SIGINT, sighandler);
 
+	// The checks choose the layout and clock, the environment is for the rest
+	layoutEnv = getenv("RT_POOL_LAYOUT");
+	clockEnv = getenv("RT_CLOCK");
+	unsetenv("RT_POOL_LAYOUT");
+	unsetenv("RT_CLOCK");
+
+	checkIncremental(RT_LAYOUT_SHARED);
+	checkIncremental(RT_LAYOUT_LOCAL);
+	checkClock(RT_CLOCK_RAW);
+	checkClock(RT_CLOCK_TSC);
+	checkClock(RT_CLOCK_COARSE);
+	checkBinary(RT_LAYOUT_SHARED);
+	checkBinary(RT_LAYOUT_LOCAL);
+
+	runtrace_layout(RT_LAYOUT_SHARED);
+	runtrace_clock(RT_CLOCK_RAW);
+	if (layoutEnv)  setenv("RT_POOL_LAYOUT", layoutEnv, 1);
+	if (clockEnv)  setenv("RT_CLOCK", clockEnv, 1);
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		exit(1);
+	}
+
 	runtrace_flush_on_abort(1);
 	runtrace_init(numberOfThreads+1);
 